@@ -0,0 +1,154 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "evweb.h"
+#include "arena.h"
+
+#ifndef DEBUG_ARENA
+  #ifdef DEBUG
+    #define DEBUG_ARENA 1
+  #else
+    #define DEBUG_ARENA 0
+  #endif
+#endif
+
+#if DEBUG_ARENA
+  #define print_debug(...) printf("[arena] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[arena] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[arena] " __VA_ARGS__)
+
+// keep every allocation aligned well enough for the header line structs
+#define ARENA_ALIGN(size) (((size) + (sizeof (void*) - 1)) & ~(sizeof (void*) - 1))
+
+struct evweb_arena_block {
+  evweb_arena_block* next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+static evweb_arena_block* new_block(evweb_arena* arena, size_t min_size) {
+  evweb_arena_block* block;
+  size_t size = EVWEB_ARENA_BLOCK_SIZE;
+
+  while (size < min_size)
+  {
+    size *= 2;
+  }
+
+  block = malloc(sizeof (evweb_arena_block) + size);
+  if (NULL == block)
+  {
+    print_err("failed to allocate %zu byte arena block: %s\n", size, strerror(errno));
+    return NULL;
+  }
+  block->size = size;
+  block->used = 0;
+  block->next = arena->blocks;
+  arena->blocks = block;
+  arena->capacity += size;
+
+  print_debug("added %zu byte block to arena %p (capacity now %zu)\n", size, arena, arena->capacity);
+  return block;
+}
+
+void* arena_alloc(evweb_arena* arena, size_t size) {
+  evweb_arena_block* block = arena->blocks;
+  void* ptr;
+
+  size = ARENA_ALIGN(size);
+  if ( (NULL == block) || (block->size - block->used < size) )
+  {
+    block = new_block(arena, size);
+    if (NULL == block)
+    {
+      return NULL;
+    }
+  }
+
+  ptr = block->data + block->used;
+  block->used += size;
+  arena->last = ptr;
+  return ptr;
+}
+
+// grow an allocation, in place when it is the most recent one and its block still has room
+void* arena_extend(evweb_arena* arena, void* ptr, size_t old_size, size_t new_size) {
+  evweb_arena_block* block = arena->blocks;
+  size_t start;
+  void* new_ptr;
+
+  if (NULL == ptr)
+  {
+    return arena_alloc(arena, new_size);
+  }
+
+  if ( (ptr == arena->last) && (NULL != block) )
+  {
+    start = (char*)ptr - block->data;
+    if (block->size - start >= ARENA_ALIGN(new_size))
+    {
+      block->used = start + ARENA_ALIGN(new_size);
+      return ptr;
+    }
+  }
+
+  new_ptr = arena_alloc(arena, new_size);
+  if (NULL == new_ptr)
+  {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, old_size);
+  return new_ptr;
+}
+
+// Forget everything allocated since the last reset. If the last message needed more than one
+// block we replace them with a single block big enough for all of it, so a connection that
+// keeps sending similar requests settles into one block and never allocates again. Anything
+// past EVWEB_ARENA_MAX_RETAINED (a large upload, say) is given back instead of kept.
+void arena_reset(evweb_arena* arena) {
+  evweb_arena_block* block;
+  size_t capacity = arena->capacity;
+
+  arena->last = NULL;
+  if (NULL == arena->blocks)
+  {
+    return;
+  }
+
+  if ( (NULL == arena->blocks->next) && (capacity <= EVWEB_ARENA_MAX_RETAINED) )
+  {
+    arena->blocks->used = 0;
+    return;
+  }
+
+  arena_destroy(arena);
+  if (capacity > EVWEB_ARENA_MAX_RETAINED)
+  {
+    capacity = EVWEB_ARENA_MAX_RETAINED;
+  }
+  block = new_block(arena, capacity);
+  if (NULL == block)
+  {
+    print_debug("could not consolidate arena %p, it will start empty\n", arena);
+  }
+}
+
+void arena_destroy(evweb_arena* arena) {
+  evweb_arena_block* block;
+
+  while (NULL != arena->blocks)
+  {
+    block = arena->blocks;
+    arena->blocks = block->next;
+    free(block);
+  }
+  arena->capacity = 0;
+  arena->last = NULL;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "evweb.h"
+#include "body-segment.h"
+
+#ifndef DEBUG_BODY_SEGMENT
+  #ifdef DEBUG
+    #define DEBUG_BODY_SEGMENT 1
+  #else
+    #define DEBUG_BODY_SEGMENT 0
+  #endif
+#endif
+
+#if DEBUG_BODY_SEGMENT
+  #define print_debug(...) printf("[body-segment] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[body-segment] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[body-segment] " __VA_ARGS__)
+
+// Response bodies are built in a chain of segments instead of one buffer that gets realloc'd
+// and copied on every append. Standard sized segments come from a free list on the worker, so
+// a busy worker stops calling malloc for bodies altogether. Anything bigger is a one off.
+evweb_body_segment* acquire_segment(evweb_worker* worker, size_t capacity) {
+  evweb_body_segment* segment;
+
+  if ( (capacity <= EVWEB_BODY_SEGMENT_SIZE) && (NULL != worker->free_segments) )
+  {
+    segment = worker->free_segments;
+    worker->free_segments = segment->next;
+    worker->num_free_segments -= 1;
+  }
+  else
+  {
+    if (capacity < EVWEB_BODY_SEGMENT_SIZE)
+    {
+      capacity = EVWEB_BODY_SEGMENT_SIZE;
+    }
+    segment = malloc(sizeof (evweb_body_segment) + capacity);
+    if (NULL == segment)
+    {
+      print_err("failed to allocate memory for a body segment: %s\n", strerror(errno));
+      return NULL;
+    }
+    segment->capacity = capacity;
+  }
+
+  segment->next = NULL;
+  segment->length = 0;
+  segment->ref = NULL;
+  segment->release = NULL;
+  segment->release_ctx = NULL;
+  return segment;
+}
+
+// A segment standing in for bytes we were lent rather than copied, so they can sit in a body
+// between ones we own. Its capacity is its length so nothing is ever added to it, and release
+// is called once it's been written or thrown away.
+evweb_body_segment* lend_segment(void* ref, size_t length, evweb_release_cb* release, void* release_ctx) {
+  evweb_body_segment* segment;
+
+  segment = malloc(sizeof (evweb_body_segment));
+  if (NULL == segment)
+  {
+    print_err("failed to allocate memory for a body segment: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  segment->next = NULL;
+  segment->length = length;
+  segment->capacity = length;
+  segment->ref = ref;
+  segment->release = release;
+  segment->release_ctx = release_ctx;
+  return segment;
+}
+
+// where the segment's bytes are, whether they're ours or lent
+char* segment_bytes(evweb_body_segment* segment) {
+  return (NULL == segment->ref) ? segment->data : segment->ref;
+}
+
+void release_segment(evweb_worker* worker, evweb_body_segment* segment) {
+  if (NULL != segment->ref)
+  {
+    if (NULL != segment->release)
+    {
+      segment->release(segment->release_ctx, segment->ref);
+    }
+    free(segment);
+    return;
+  }
+  if ( (EVWEB_BODY_SEGMENT_SIZE != segment->capacity) || (worker->num_free_segments >= EVWEB_MAX_POOLED_SEGMENTS) )
+  {
+    free(segment);
+    return;
+  }
+
+  segment->next = worker->free_segments;
+  worker->free_segments = segment;
+  worker->num_free_segments += 1;
+}
+
+void release_segment_chain(evweb_worker* worker, evweb_body_segment* segment) {
+  evweb_body_segment* next;
+
+  while (NULL != segment)
+  {
+    next = segment->next;
+    release_segment(worker, segment);
+    segment = next;
+  }
+}
+
+void destroy_segment_pool(evweb_worker* worker) {
+  evweb_body_segment* segment;
+
+  while (NULL != worker->free_segments)
+  {
+    segment = worker->free_segments;
+    worker->free_segments = segment->next;
+    free(segment);
+  }
+  worker->num_free_segments = 0;
+}
+
+// Find length contiguous bytes at the end of the response's body, starting a new segment if the
+// last one doesn't have the room. Nothing counts as part of the body until it's committed.
+void* reserve_body_space(evweb_worker* worker, evweb_response* response, size_t length) {
+  evweb_body_segment* segment = response->body_last;
+
+  if ( (NULL != segment) && (segment->capacity - segment->length >= length) )
+  {
+    return segment->data + segment->length;
+  }
+
+  segment = acquire_segment(worker, length);
+  if (NULL == segment)
+  {
+    return NULL;
+  }
+  print_debug("starting a %zu byte body segment\n", segment->capacity);
+
+  if (NULL == response->body_last)
+  {
+    response->body = segment;
+  }
+  else
+  {
+    response->body_last->next = segment;
+  }
+  response->body_last = segment;
+  return segment->data;
+}
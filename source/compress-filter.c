@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <zlib.h>
+
+#include "compress-filter.h"
+#include "body-segment.h"
+
+#ifndef DEBUG_COMPRESS_FILTER
+  #ifdef DEBUG
+    #define DEBUG_COMPRESS_FILTER 1
+  #else
+    #define DEBUG_COMPRESS_FILTER 0
+  #endif
+#endif
+
+#if DEBUG_COMPRESS_FILTER
+  #define print_debug(...) printf("[compress-filter] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[compress-filter] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[compress-filter] " __VA_ARGS__)
+
+// the codings we can produce, most preferred first. Window bits 15 gives the zlib format HTTP
+// calls deflate, and adding 16 wraps the same stream as gzip
+static const struct {
+  char* coding;
+  int window_bits;
+} codings[EVWEB_NUM_CODINGS] = {
+  { "gzip",    15 + 16 },
+  { "deflate", 15 },
+};
+
+// the level to compress at while the loop is running at most max_lag seconds behind
+static const struct {
+  ev_tstamp max_lag;
+  int level;
+} compress_levels[] = {
+  { 0.005, 6 },
+  { 0.020, 4 },
+  { 0.050, 2 },
+  { 0,     1 },
+};
+#define NUM_COMPRESS_LEVELS (sizeof compress_levels / sizeof compress_levels[0])
+
+static const char* compressible_types[] = {
+  "text/",
+  "application/json",
+  "application/javascript",
+  "application/xml",
+  "image/svg+xml",
+};
+#define NUM_COMPRESSIBLE_TYPES (sizeof compressible_types / sizeof compressible_types[0])
+
+static bool is_compressible(char* type);
+static bool has_header(evweb_response* response, char* field);
+static bool varies_on_encoding(evweb_response* response);
+static void weaken_etag(evweb_response* response);
+static z_stream* get_compressor(evweb_worker* worker, int coding);
+static int deflate_into(evweb_worker* worker, z_stream* stream, evweb_body_segment** last, size_t* total, size_t limit, void* data, size_t length, int flush);
+static void on_lag_check(EV_P, ev_timer* watcher, int revents);
+
+void start_compress_filter(evweb_worker* worker) {
+  worker->compress_level = compress_levels[0].level;
+  if (worker->server->settings->compress_min_length < 0)
+  {
+    return;
+  }
+
+  worker->lag_check_time = ev_now(worker->EV_A);
+  ev_timer_init(&(worker->lag_timer), on_lag_check, EVWEB_LAG_CHECK_INTERVAL, EVWEB_LAG_CHECK_INTERVAL);
+  worker->lag_timer.data = worker;
+  ev_timer_start(worker->EV_A, &(worker->lag_timer));
+  // watching the lag shouldn't keep the loop running by itself
+  ev_unref(worker->EV_A);
+}
+
+void stop_compress_filter(evweb_worker* worker) {
+  if (ev_is_active(&(worker->lag_timer)))
+  {
+    ev_ref(worker->EV_A);
+    ev_timer_stop(worker->EV_A, &(worker->lag_timer));
+  }
+}
+
+void destroy_compress_filter(evweb_worker* worker) {
+  int i;
+
+  for (i = 0; i < EVWEB_NUM_CODINGS; i += 1)
+  {
+    if (NULL != worker->compressors[i])
+    {
+      deflateEnd(worker->compressors[i]);
+      free(worker->compressors[i]);
+      worker->compressors[i] = NULL;
+    }
+  }
+}
+
+// Compress the response body in place if it's worth it and the client can take it. Only whole
+// bodies in memory we own are compressed: a file goes out with sendfile as it is, a lent body
+// is sent from where it is (whoever lent it can lend a compressed one), and a streamed body
+// never passes through here. Returns non-zero if the response can no longer be sent as it is.
+int compress_response(evweb_exchange* exchange, evweb_response* response) {
+  evweb_worker* worker = ((evweb_http_processer*)response->connection->send_data)->worker;
+  int min_length = worker->server->settings->compress_min_length;
+  long max_length = worker->server->settings->compress_max_length;
+  char* accept_encoding;
+  evweb_body_segment* first;
+  evweb_body_segment* last;
+  evweb_body_segment* segment;
+  z_stream* stream;
+  size_t total = 0;
+  int coding;
+  int ret = 0;
+
+  if (0 == min_length)
+  {
+    min_length = EVWEB_DEFAULT_COMPRESS_MIN_LENGTH;
+  }
+  if (0 == max_length)
+  {
+    max_length = EVWEB_DEFAULT_COMPRESS_MAX_LENGTH;
+  }
+  // deflating holds up the whole loop, so past a point it costs every other connection more
+  // than it saves this one
+  if ( (max_length > 0) && (response->content_length > (size_t)max_length) )
+  {
+    return 0;
+  }
+  if ( (min_length < 0) || (response->content_length < (size_t)min_length) || (-1 != response->body_fd) || (NULL != response->body_ref) ||
+       (response->status < 200) || (204 == response->status) || (206 == response->status) || (304 == response->status) ||
+       (false == is_compressible(response->content_type)) || (true == has_header(response, "Content-Encoding")) )
+  {
+    return 0;
+  }
+
+  for (segment = response->body; NULL != segment; segment = segment->next)
+  {
+    if (NULL != segment->ref)
+    {
+      // lent pieces are left as they are, just like a whole lent body
+      return 0;
+    }
+  }
+
+  // whatever we end up sending, caches have to know it depended on Accept-Encoding
+  if (false == varies_on_encoding(response))
+  {
+    add_response_header(response, "Vary", "Accept-Encoding");
+  }
+  // HEAD goes through the same compression as GET, so its Content-Length and Content-Encoding
+  // are the ones a GET would get. Only a HEAD that gave just a length has nothing to compress
+  if (NULL == response->body)
+  {
+    return 0;
+  }
+
+  accept_encoding = get_request_header(&(exchange->request), "Accept-Encoding");
+  if (NULL == accept_encoding)
+  {
+    return 0;
+  }
+  for (coding = 0; coding < EVWEB_NUM_CODINGS; coding += 1)
+  {
+    if (true == accepts_encoding(accept_encoding, codings[coding].coding))
+    {
+      break;
+    }
+  }
+  if (EVWEB_NUM_CODINGS == coding)
+  {
+    return 0;
+  }
+
+  stream = get_compressor(worker, coding);
+  first = acquire_segment(worker, EVWEB_BODY_SEGMENT_SIZE);
+  if ( (NULL == stream) || (NULL == first) )
+  {
+    if (NULL != first)
+    {
+      release_segment(worker, first);
+    }
+    return 0;
+  }
+  last = first;
+  stream->next_out = (Bytef*)first->data;
+  stream->avail_out = first->capacity;
+
+  // give up as soon as the output isn't smaller than the input, it isn't worth sending
+  for (segment = response->body; (NULL != segment) && (0 == ret); segment = segment->next)
+  {
+    ret = deflate_into(worker, stream, &last, &total, response->content_length, segment->data, segment->length, Z_NO_FLUSH);
+  }
+  if (0 == ret)
+  {
+    ret = deflate_into(worker, stream, &last, &total, response->content_length, NULL, 0, Z_FINISH);
+  }
+  last->length = last->capacity - stream->avail_out;
+  total += last->length;
+  if ( (0 != ret) || (total >= response->content_length) )
+  {
+    print_debug("compressing %zu bytes of %s didn't pay off, sending it as it is\n", response->content_length, response->content_type);
+    release_segment_chain(worker, first);
+    return 0;
+  }
+
+  print_debug("compressed %zu bytes of %s to %zu with %s at level %d\n", response->content_length, response->content_type, total,
+              codings[coding].coding, worker->compress_level);
+  if (NULL != response->body)
+  {
+    release_segment_chain(worker, response->body);
+  }
+  response->body = first;
+  response->body_last = last;
+  response->content_length = total;
+  weaken_etag(response);
+
+  return add_response_header(response, "Content-Encoding", codings[coding].coding);
+}
+
+// true if the Accept-Encoding value lists coding (or *) without ruling it out with q=0
+bool accepts_encoding(char* accept_encoding, char* coding) {
+  size_t coding_length = strlen(coding);
+  char* cur_pos = accept_encoding;
+  char* token;
+  size_t token_length;
+  char* quality;
+
+  while ('\0' != *cur_pos)
+  {
+    while ( (' ' == *cur_pos) || ('\t' == *cur_pos) || (',' == *cur_pos) )
+    {
+      cur_pos += 1;
+    }
+    token = cur_pos;
+    while ( ('\0' != *cur_pos) && (',' != *cur_pos) && (';' != *cur_pos) && (' ' != *cur_pos) && ('\t' != *cur_pos) )
+    {
+      cur_pos += 1;
+    }
+    token_length = cur_pos - token;
+
+    quality = NULL;
+    while ( ('\0' != *cur_pos) && (',' != *cur_pos) )
+    {
+      if ( ('q' == *cur_pos) && ('=' == cur_pos[1]) )
+      {
+        quality = cur_pos + 2;
+      }
+      cur_pos += 1;
+    }
+
+    if ( (0 == token_length) || ( ((token_length != coding_length) || (0 != strncasecmp(token, coding, coding_length))) && ((1 != token_length) || ('*' != *token)) ) )
+    {
+      continue;
+    }
+    // q=0, q=0.0, q=0.000 and so on all mean "not this one"
+    if (NULL != quality)
+    {
+      if ('0' != *quality)
+      {
+        return true;
+      }
+      for (quality += 1; '.' == *quality || '0' == *quality; quality += 1);
+      return ( (',' != *quality) && ('\0' != *quality) && (' ' != *quality) );
+    }
+    return true;
+  }
+  return false;
+}
+
+static bool is_compressible(char* type) {
+  size_t i;
+
+  if (NULL == type)
+  {
+    return false;
+  }
+  for (i = 0; i < NUM_COMPRESSIBLE_TYPES; i += 1)
+  {
+    if (0 == strncasecmp(type, compressible_types[i], strlen(compressible_types[i])))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool has_header(evweb_response* response, char* field) {
+  int i;
+
+  for (i = 0; i < response->num_header_lines; i += 1)
+  {
+    if (0 == strcasecmp(response->header_lines[i].field, field))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the handler might already have said so, like the static handler does when it has variants
+static bool varies_on_encoding(evweb_response* response) {
+  int i;
+
+  for (i = 0; i < response->num_header_lines; i += 1)
+  {
+    if ( (0 == strcasecmp(response->header_lines[i].field, "Vary")) && (NULL != strcasestr(response->header_lines[i].value, "Accept-Encoding")) )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// A strong ETag promises these exact bytes, which stops being true once we've compressed them
+// (and the output can vary with the level), so it's downgraded to a weak one
+static void weaken_etag(evweb_response* response) {
+  evweb_header_line* line;
+  char* value;
+  int i;
+
+  for (i = 0; i < response->num_header_lines; i += 1)
+  {
+    line = response->header_lines + i;
+    if ( (0 != strcasecmp(line->field, "ETag")) || ('"' != line->value[0]) )
+    {
+      continue;
+    }
+    value = malloc(line->value_len + 3);
+    if (NULL == value)
+    {
+      return;
+    }
+    memcpy(value, "W/", 2);
+    memcpy(value + 2, line->value, line->value_len + 1);
+    free(line->value);
+    line->value = value;
+    line->value_len += 2;
+  }
+}
+
+// Every response on a worker reuses the same stream for a coding, so zlib's sizable state is
+// only allocated once. It's brought to the worker's current level before each use.
+static z_stream* get_compressor(evweb_worker* worker, int coding) {
+  z_stream* stream = worker->compressors[coding];
+
+  if (NULL == stream)
+  {
+    stream = calloc(1, sizeof (z_stream));
+    if (NULL == stream)
+    {
+      print_err("failed to allocate memory for a %s stream: %s\n", codings[coding].coding, strerror(errno));
+      return NULL;
+    }
+    if (Z_OK != deflateInit2(stream, worker->compress_level, Z_DEFLATED, codings[coding].window_bits, 8, Z_DEFAULT_STRATEGY))
+    {
+      print_err("failed to start a %s stream: %s\n", codings[coding].coding, (NULL == stream->msg) ? "unknown error" : stream->msg);
+      free(stream);
+      return NULL;
+    }
+    worker->compressors[coding] = stream;
+    worker->compressor_levels[coding] = worker->compress_level;
+    return stream;
+  }
+
+  deflateReset(stream);
+  if (worker->compressor_levels[coding] != worker->compress_level)
+  {
+    // nothing has gone through the stream since the reset, so changing the level is cheap
+    deflateParams(stream, worker->compress_level, Z_DEFAULT_STRATEGY);
+    worker->compressor_levels[coding] = worker->compress_level;
+  }
+  return stream;
+}
+
+// Run length bytes through the stream, adding segments to the output chain as they fill up.
+// Returns -1 once the output reaches limit bytes or something went wrong.
+static int deflate_into(evweb_worker* worker, z_stream* stream, evweb_body_segment** last, size_t* total, size_t limit, void* data, size_t length, int flush) {
+  evweb_body_segment* segment;
+  int ret;
+
+  stream->next_in = (Bytef*)data;
+  stream->avail_in = length;
+  while (true)
+  {
+    if (0 == stream->avail_out)
+    {
+      (*last)->length = (*last)->capacity;
+      *total += (*last)->length;
+      if (*total >= limit)
+      {
+        return -1;
+      }
+      segment = acquire_segment(worker, EVWEB_BODY_SEGMENT_SIZE);
+      if (NULL == segment)
+      {
+        return -1;
+      }
+      (*last)->next = segment;
+      *last = segment;
+      stream->next_out = (Bytef*)segment->data;
+      stream->avail_out = segment->capacity;
+    }
+
+    ret = deflate(stream, flush);
+    if (Z_STREAM_ERROR == ret)
+    {
+      print_err("deflate failed: %s\n", (NULL == stream->msg) ? "unknown error" : stream->msg);
+      return -1;
+    }
+    if (Z_FINISH == flush)
+    {
+      if (Z_STREAM_END == ret)
+      {
+        return 0;
+      }
+    }
+    else if ( (0 == stream->avail_in) && (0 != stream->avail_out) )
+    {
+      return 0;
+    }
+  }
+}
+
+// A loop with more work than it can keep up with runs its timers late. Keep a smoothed measure
+// of how late, and trade compression ratio for CPU as it grows.
+static void on_lag_check(EV_P, ev_timer* watcher, int revents) {
+  evweb_worker* worker = (evweb_worker*)watcher->data;
+  ev_tstamp now = ev_now(EV_A);
+  ev_tstamp lag;
+  size_t i;
+
+  lag = now - worker->lag_check_time - EVWEB_LAG_CHECK_INTERVAL;
+  if (lag < 0)
+  {
+    lag = 0;
+  }
+  worker->lag_check_time = now;
+  worker->loop_lag = 0.7 * worker->loop_lag + 0.3 * lag;
+
+  for (i = 0; i < NUM_COMPRESS_LEVELS - 1; i += 1)
+  {
+    if (worker->loop_lag < compress_levels[i].max_lag)
+    {
+      break;
+    }
+  }
+  if (worker->compress_level != compress_levels[i].level)
+  {
+    print_debug("worker %d is running %.1fms behind, compressing at level %d\n", worker->index, worker->loop_lag * 1000, compress_levels[i].level);
+    worker->compress_level = compress_levels[i].level;
+  }
+}
@@ -2,8 +2,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
 
 #include "evweb-connect-iface.h"
+#include "compress-filter.h"
+#include "response-writer.h"
+#include "regex-set.h"
+#include "router.h"
+#include "static-index.h"
 
 #ifndef DEBUG_CONNECT_IFACE
   #ifdef DEBUG
@@ -24,24 +31,54 @@
 #define EVWEB_CNCT_GENERAL  10
 #define EVWEB_CNCT_ROUTER   11
 #define EVWEB_CNCT_STATIC   12
+#define EVWEB_CNCT_REGEX    13
+
+// precompressed copies of a static file we look for next to it, most preferred first
+static const struct {
+  char* suffix;
+  char* coding;
+} static_variants[] = {
+  { ".br", "br" },
+  { ".gz", "gzip" },
+};
+#define NUM_STATIC_VARIANTS (sizeof static_variants / sizeof static_variants[0])
+
+// more ranges than this in one request and we send the whole file instead, as does a
+// multipart response that would need more than this many bytes copied together
+#define EVWEB_STATIC_MAX_RANGES     16
+#define EVWEB_STATIC_MAX_MULTIPART  (1024 * 1024)
+
+typedef struct {
+  size_t start;
+  size_t length;
+} static_range;
 
 struct priv_connect_cb {
   int cb_type;
   enum http_method method;
   char* resource;
   evweb_connect_cb* cb;
+  evweb_static_index* index;
 };
 
-static evweb_connect_iface* static_iface;
-
 static void request_handler(evweb_request* request, evweb_response* response);
-static void serve_static_file(evweb_request* request, evweb_response* response, bool* next, char* directory);
+static void serve_static_file(evweb_request* request, evweb_response* response, bool* next, struct priv_connect_cb* static_cb);
+static evweb_static_entry* find_variant(evweb_static_index* index, int reader, unsigned long now, char* path, size_t path_length, char* suffix);
+static int parse_ranges(evweb_request* request, evweb_static_entry* entry, static_range* ranges);
+static int add_multipart_body(evweb_response* response, evweb_worker* worker, evweb_static_entry* entry, char* data, int fd, char* type,
+                              static_range* ranges, int num_ranges);
+static bool is_modified(evweb_request* request, evweb_static_entry* entry);
+static bool etag_matches(char* if_none_match, char* etag);
 static char* guess_content_type(char* extension);
 
 void evweb_init_connect_iface(evweb_connect_iface* iface) {
   iface->cb_count = 0;
   iface->max_cb_count = 8;
   iface->cbs = calloc(iface->max_cb_count, sizeof (struct priv_connect_cb));
+  iface->router = NULL;
+  iface->regex_routes = NULL;
+  iface->chain = calloc(iface->max_cb_count, sizeof (int));
+  iface->chain_length = 0;
 }
 
 static struct priv_connect_cb* next_unused_cb(evweb_connect_iface* iface) {
@@ -50,7 +87,8 @@ static struct priv_connect_cb* next_unused_cb(evweb_connect_iface* iface) {
   {
     iface->max_cb_count *= 2;
     iface->cbs = realloc(iface->cbs, iface->max_cb_count * sizeof (struct priv_connect_cb));
-    if (NULL == iface->cbs)
+    iface->chain = realloc(iface->chain, iface->max_cb_count * sizeof (int));
+    if ( (NULL == iface->cbs) || (NULL == iface->chain) )
     {
       print_err("failed to allocate memory for the connect callbacks: %s\n", strerror(errno));
       return NULL;
@@ -60,6 +98,12 @@ static struct priv_connect_cb* next_unused_cb(evweb_connect_iface* iface) {
   return ((struct priv_connect_cb*)iface->cbs) + (iface->cb_count - 1);
 }
 
+// every callback that isn't a router gets a turn at each request, in the order they were added
+static void add_to_chain(evweb_connect_iface* iface) {
+  iface->chain[iface->chain_length] = iface->cb_count - 1;
+  iface->chain_length += 1;
+}
+
 int evweb_connect_add_function(evweb_connect_iface* iface, evweb_connect_cb cb) {
   struct priv_connect_cb* new_cb;
   new_cb = next_unused_cb(iface);
@@ -71,6 +115,7 @@ int evweb_connect_add_function(evweb_connect_iface* iface, evweb_connect_cb cb)
 
   new_cb->cb_type = EVWEB_CNCT_GENERAL;
   new_cb->cb = cb;
+  add_to_chain(iface);
 
   return 0;
 }
@@ -96,10 +141,61 @@ int evweb_connect_add_router(evweb_connect_iface* iface, enum http_method method
   }
   strncpy(new_cb->resource, resource, strlen(resource) + 1);
 
+  if (NULL == iface->router)
+  {
+    iface->router = router_create();
+    if (NULL == iface->router)
+    {
+      return errno;
+    }
+  }
+  if (0 != router_add(iface->router, method, new_cb->resource, iface->cb_count - 1))
+  {
+    return errno;
+  }
+
   return 0;
 }
 
-int evweb_connect_add_static(evweb_connect_iface* iface, char* directory) {
+int evweb_connect_add_regex_router(evweb_connect_iface* iface, enum http_method method, char* pattern, evweb_connect_cb cb) {
+  struct priv_connect_cb* new_cb;
+
+  new_cb = next_unused_cb(iface);
+
+  if (NULL == new_cb)
+  {
+    return errno;
+  }
+
+  new_cb->cb_type = EVWEB_CNCT_REGEX;
+  new_cb->method = method;
+  new_cb->cb = cb;
+  new_cb->resource = malloc(strlen(pattern) + 1);
+  if (NULL == new_cb->resource)
+  {
+    print_err("failed to allocate memory for the router pattern: %s\n", strerror(errno));
+    return errno;
+  }
+  strncpy(new_cb->resource, pattern, strlen(pattern) + 1);
+
+  // the pattern is checked now, but it only joins the DFA when the server starts
+  if (NULL == iface->regex_routes)
+  {
+    iface->regex_routes = regex_set_create();
+    if (NULL == iface->regex_routes)
+    {
+      return errno;
+    }
+  }
+  if (0 != regex_set_add(iface->regex_routes, new_cb->resource, iface->cb_count - 1))
+  {
+    return errno;
+  }
+
+  return 0;
+}
+
+static int add_static(evweb_connect_iface* iface, char* directory, size_t cache_size, bool map_files) {
   struct priv_connect_cb* new_cb;
 
   new_cb = next_unused_cb(iface);
@@ -110,6 +206,8 @@ int evweb_connect_add_static(evweb_connect_iface* iface, char* directory) {
   }
 
   new_cb->cb_type = EVWEB_CNCT_STATIC;
+  new_cb->index = NULL;
+  add_to_chain(iface);
   new_cb->resource = malloc(strlen(directory) + 1);
   if (NULL == new_cb->resource)
   {
@@ -118,9 +216,48 @@ int evweb_connect_add_static(evweb_connect_iface* iface, char* directory) {
   }
   strncpy(new_cb->resource, directory, strlen(directory) + 1);
 
+  // the directory is scanned when the server starts, and kept up to date with inotify after that
+  new_cb->index = static_index_create(directory, cache_size, map_files, guess_content_type);
+  if (NULL == new_cb->index)
+  {
+    return errno;
+  }
+
   return 0;
 }
 
+int evweb_connect_add_static(evweb_connect_iface* iface, char* directory) {
+  return add_static(iface, directory, 0, false);
+}
+
+// serve the directory like evweb_connect_add_static, but keep up to cache_size bytes of its
+// smaller files in memory, shared by every worker
+int evweb_connect_add_static_cached(evweb_connect_iface* iface, char* directory, size_t cache_size) {
+  return add_static(iface, directory, cache_size, false);
+}
+
+// serve the directory like evweb_connect_add_static, but map mid-sized files into memory once
+// and have every response send slices of the one mapping instead of going back to the file
+int evweb_connect_add_static_mapped(evweb_connect_iface* iface, char* directory) {
+  return add_static(iface, directory, 0, true);
+}
+
+// what the route that matched captured for name, as a span of request->url that isn't nul
+// terminated. Returns NULL if the route has no such parameter
+char* evweb_connect_route_param(evweb_request* request, char* name, size_t* length) {
+  int i;
+
+  for (i = 0; i < request->num_params; i += 1)
+  {
+    if (0 == strcmp(request->params[i].name, name))
+    {
+      *length = request->params[i].length;
+      return request->url + request->params[i].offset;
+    }
+  }
+  return NULL;
+}
+
 void evweb_destroy_connect_iface(evweb_connect_iface* iface) {
   int i;
   struct priv_connect_cb* cur_cb;
@@ -129,6 +266,10 @@ void evweb_destroy_connect_iface(evweb_connect_iface* iface) {
   for (i = 0; i < iface->cb_count; i += 1)
   {
     free(cur_cb->resource);
+    if ( (EVWEB_CNCT_STATIC == cur_cb->cb_type) && (NULL != cur_cb->index) )
+    {
+      static_index_destroy(cur_cb->index);
+    }
     cur_cb += 1;
   }
 
@@ -136,16 +277,61 @@ void evweb_destroy_connect_iface(evweb_connect_iface* iface) {
   iface->max_cb_count = 0;
   free(iface->cbs);
   iface->cbs = NULL;
+  free(iface->chain);
+  iface->chain = NULL;
+  iface->chain_length = 0;
+  if (NULL != iface->router)
+  {
+    router_destroy(iface->router);
+    iface->router = NULL;
+  }
+  if (NULL != iface->regex_routes)
+  {
+    regex_set_destroy(iface->regex_routes);
+    iface->regex_routes = NULL;
+  }
 }
 
-void evweb_start_connect_server(EV_P, int port, evweb_server_settings* settings, evweb_connect_iface* iface) {
-  static_iface = iface;
-  evweb_start_server(EV_A, port, settings, request_handler);
+evweb_server* evweb_start_connect_server(EV_P, int port, evweb_server_settings* settings, evweb_connect_iface* iface) {
+  int i;
+  int num_workers;
+  struct priv_connect_cb* cur_cb;
+
+  // every worker reads the indexes, so they need to know how many workers there will be
+  num_workers = (settings->workers < 1) ? 1 : settings->workers;
+  cur_cb = (struct priv_connect_cb*)iface->cbs;
+  for (i = 0; i < iface->cb_count; i += 1)
+  {
+    if ( (EVWEB_CNCT_STATIC == cur_cb->cb_type) && (NULL != cur_cb->index) )
+    {
+      if (0 != static_index_start(EV_A, cur_cb->index, num_workers))
+      {
+        return NULL;
+      }
+    }
+    cur_cb += 1;
+  }
+
+  if ( (NULL != iface->regex_routes) && (0 != regex_set_compile(iface->regex_routes)) )
+  {
+    return NULL;
+  }
+
+  return evweb_start_server(EV_A, port, settings, request_handler, iface);
 }
 
 static void request_handler(evweb_request* request, evweb_response* response) {
   int i;
+  int route;
+  int pattern;
+  int link;
+  int* routes = NULL;
+  int num_routes = 0;
+  int* patterns = NULL;
+  int num_patterns = 0;
+  size_t path_offset;
   bool next = true;
+  evweb_connect_iface* iface = (evweb_connect_iface*)request->server->data;
   struct priv_connect_cb* cur_cb;
   char*     path_start;
   u_int16_t path_length;
@@ -157,11 +343,55 @@ static void request_handler(evweb_request* request, evweb_response* response) {
   path_start  = request->url + request->parsed_url_info.field_data[UF_PATH].off;
   path_length = request->parsed_url_info.field_data[UF_PATH].len;
 
-  print_debug("received a request for resource %.*s, running through %d callbacks\n", path_length, path_start, static_iface->cb_count);
+  // the trie hands back just the routers for this method and path, and they're merged into the
+  // rest of the chain by position so everything still runs in the order it was added
+  request->num_params = 0;
+  if (NULL != iface->router)
+  {
+    routes = router_lookup(iface->router, request->method, path_start, path_length, request->params, &(request->num_params), &num_routes);
+    // captures come back relative to the path, handlers get them relative to the url
+    path_offset = path_start - request->url;
+    for (i = 0; i < request->num_params; i += 1)
+    {
+      request->params[i].offset += path_offset;
+    }
+  }
+  if (NULL != iface->regex_routes)
+  {
+    patterns = regex_set_match(iface->regex_routes, path_start, path_length, &num_patterns);
+  }
+  print_debug("received a request for resource %.*s, running through %d callbacks\n", path_length, path_start,
+              iface->chain_length + num_routes + num_patterns);
 
-  cur_cb = (struct priv_connect_cb*)static_iface->cbs;
-  for(i = 0; i < static_iface->cb_count; i += 1)
+  route = 0;
+  pattern = 0;
+  link = 0;
+  while ( (route < num_routes) || (pattern < num_patterns) || (link < iface->chain_length) )
   {
+    // take whichever of the three lists has the earliest callback next
+    i = (link < iface->chain_length) ? iface->chain[link] : INT_MAX;
+    if ( (route < num_routes) && (routes[route] < i) )
+    {
+      i = routes[route];
+    }
+    if ( (pattern < num_patterns) && (patterns[pattern] < i) )
+    {
+      i = patterns[pattern];
+    }
+    if ( (route < num_routes) && (routes[route] == i) )
+    {
+      route += 1;
+    }
+    else if ( (pattern < num_patterns) && (patterns[pattern] == i) )
+    {
+      pattern += 1;
+    }
+    else
+    {
+      link += 1;
+    }
+    cur_cb = ((struct priv_connect_cb*)iface->cbs) + i;
+
     if (EVWEB_CNCT_GENERAL == cur_cb->cb_type)
     {
       print_debug("callback %d is a general type\n", i);
@@ -170,15 +400,21 @@ static void request_handler(evweb_request* request, evweb_response* response) {
     }
     if (EVWEB_CNCT_ROUTER == cur_cb->cb_type)
     {
-      print_debug("callback %d is a router type\n", i);
+      next = false;
+      print_debug("calling router callback %d for resource %s\n", i, cur_cb->resource);
+      cur_cb->cb(request, response, &next);
+    }
+    else if (EVWEB_CNCT_REGEX == cur_cb->cb_type)
+    {
+      // the DFA doesn't know about methods, so matches for other methods are skipped here
       if (cur_cb->method != request->method)
       {
         print_debug("HTTP request method (%d) does not match this routers method (%d)\n", request->method, cur_cb->method);
       }
-      else if (strlen(cur_cb->resource) == path_length && 0 == strncmp(path_start, cur_cb->resource, path_length))
+      else
       {
         next = false;
-        print_debug("calling router callback for resource %s\n", cur_cb->resource);
+        print_debug("calling regex router callback %d for pattern %s\n", i, cur_cb->resource);
         cur_cb->cb(request, response, &next);
       }
     }
@@ -193,7 +429,7 @@ static void request_handler(evweb_request* request, evweb_response* response) {
       {
         next = false;
         print_debug("checking directory %s for resource %.*s\n", cur_cb->resource, path_length, path_start);
-        serve_static_file(request, response, &next, cur_cb->resource);
+        serve_static_file(request, response, &next, cur_cb);
         print_debug("next = %d following the serve static call\n", next);
       }
     }
@@ -203,7 +439,6 @@ static void request_handler(evweb_request* request, evweb_response* response) {
       print_debug("the request has been handle by one of the callbacks\n");
       break;
     }
-    cur_cb += 1;
   }
 
   if (true == next)
@@ -214,20 +449,28 @@ static void request_handler(evweb_request* request, evweb_response* response) {
   }
 }
 
-static void serve_static_file(evweb_request* request, evweb_response* response, bool* next, char* directory) {
-  char full_path[256];
-  struct stat sb;
-  int fd;
-  size_t file_size;
-  char* file_buffer;
-  int err_check;
-
-  int i;
-  char* extension;
+static void serve_static_file(evweb_request* request, evweb_response* response, bool* next, struct priv_connect_cb* static_cb) {
+  evweb_static_index* index = static_cb->index;
+  evweb_worker* worker = ((evweb_http_processer*)response->connection->send_data)->worker;
+  evweb_static_entry* entry;
+  evweb_static_entry* variant;
+  char full_path[PATH_MAX];
+  unsigned long now;
+  char* accept_encoding;
+  char* encoding = NULL;
   char* type;
+  bool vary = false;
+  bool modified;
+  char* data = NULL;
+  static_range ranges[EVWEB_STATIC_MAX_RANGES];
+  int num_ranges = 0;
+  char content_range[80];
+  int fd = -1;
+  int ret;
+  int i;
 
-  char*     path_start;
-  u_int16_t path_length;
+  char*  path_start;
+  size_t path_length;
 
   if (!(request->parsed_url_info.field_set & 1 << UF_PATH)) {
     print_err("somehow got past previous error checks with invalid parsed url info\n");
@@ -239,71 +482,420 @@ static void serve_static_file(evweb_request* request, evweb_response* response,
   // the path should always start with a "/", but if that's all it is and the file index.html exists we should serve that
   if (1 == path_length)
   {
-    snprintf(full_path, sizeof full_path, "%s/index.html", directory);
+    path_start = "/index.html";
+    path_length = strlen(path_start);
   }
-  else
-  {
-    snprintf(full_path, sizeof full_path, "%s%.*s", directory, path_length, path_start);
-  }
-  print_debug("checking to see if %s exists\n", full_path);
 
-  fd = open(full_path, O_RDONLY);
-  if(-1 == fd)
+  // the index knows every file under the directory, so a miss doesn't need to touch the disk
+  now = (unsigned long)(ev_now(worker->EV_A) * 1000);
+  entry = static_index_lookup(index, worker->index, now, path_start, path_length);
+  if (NULL == entry)
   {
-    print_debug("could not open a file descriptor for %s: %s\n", full_path, strerror(errno));
+    print_debug("%s%.*s is not in the index\n", static_cb->resource, (int)path_length, path_start);
     *next = true;
     return;
   }
+  type = entry->type;
 
-  set_response_status(response, 200, NULL);
-  if (HTTP_HEAD == request->method)
+  // precompressed siblings are just more files in the index, so picking one is a lookup too.
+  // Caches have to know the response depends on Accept-Encoding whenever there's a choice
+  accept_encoding = get_request_header(request, "Accept-Encoding");
+  for (i = 0; i < NUM_STATIC_VARIANTS; i += 1)
   {
-    send_response(response);
+    variant = find_variant(index, worker->index, now, path_start, path_length, static_variants[i].suffix);
+    if (NULL == variant)
+    {
+      continue;
+    }
+    vary = true;
+    if ( (NULL == encoding) && (NULL != accept_encoding) && (true == accepts_encoding(accept_encoding, static_variants[i].coding)) )
+    {
+      static_index_release(entry, NULL);
+      entry = variant;
+      encoding = static_variants[i].coding;
+    }
+    else
+    {
+      static_index_release(variant, NULL);
+    }
+  }
+
+  // the index already has the validators, so revalidating never touches the file
+  modified = is_modified(request, entry);
+  if ( (true == modified) && (HTTP_GET == request->method) )
+  {
+    num_ranges = parse_ranges(request, entry, ranges);
+  }
+  if (-1 == num_ranges)
+  {
+    // none of the ranges asked for overlap the file
+    snprintf(content_range, sizeof content_range, "bytes */%zu", entry->size);
+    set_response_status(response, 416, NULL);
+    add_response_header(response, "Content-Range", content_range);
+    static_index_release(entry, NULL);
+    end_response(response);
     return;
   }
 
-  err_check = fstat(fd, &sb);
-  if(-1 == err_check)
+  if ( (true == modified) && (HTTP_HEAD != request->method) )
   {
-    perror("failed to stat the requested file");
-    exit(EXIT_FAILURE);
+    entry = static_index_cache(index, entry, now);
+    entry = static_index_map(index, entry);
+    data = (NULL != entry->body) ? entry->body : entry->map;
+    if (NULL == data)
+    {
+      static_index_full_path(index, entry, full_path, sizeof full_path);
+      fd = open(full_path, O_RDONLY | O_CLOEXEC);
+      if (-1 == fd)
+      {
+        // it went away since the index heard about it, inotify will catch up
+        print_debug("could not open a file descriptor for %s: %s\n", full_path, strerror(errno));
+        static_index_release(entry, NULL);
+        *next = true;
+        return;
+      }
+    }
   }
-  file_size = (size_t)sb.st_size;
 
-  file_buffer = (char*)calloc(1, file_size + 100);
-  err_check = (int)read(fd, file_buffer, file_size + 100); // try to read more just to see if it's there
-  if (err_check != (int)file_size)
+  set_response_status(response, (false == modified) ? 304 : (0 < num_ranges) ? 206 : 200, NULL);
+  add_response_header(response, "Accept-Ranges", "bytes");
+  add_response_header(response, "ETag", entry->etag);
+  add_response_header(response, "Last-Modified", entry->last_modified);
+  if ( (true == modified) && (NULL != encoding) )
   {
-    fprintf(stderr, "read %d bytes instead of the expected %zu for %s: %s\n", err_check, file_size, full_path, strerror(errno));
-    set_response_status(response, 503, "File found, but buffer failed to load");
-    free(file_buffer);
-    close(fd);
-    return;
+    add_response_header(response, "Content-Encoding", encoding);
+  }
+  if (true == vary)
+  {
+    add_response_header(response, "Vary", "Accept-Encoding");
   }
 
-  i = strlen(full_path) - 1;
-  for (; i > 0; i -= 1)
+  if (false == modified)
+  {
+    print_debug("%s has not changed, sending 304\n", entry->path);
+    static_index_release(entry, NULL);
+  }
+  else if (HTTP_HEAD == request->method)
+  {
+    set_response_length(response, entry->size, type);
+    static_index_release(entry, NULL);
+  }
+  else if (1 == num_ranges)
+  {
+    snprintf(content_range, sizeof content_range, "bytes %zu-%zu/%zu", ranges[0].start, ranges[0].start + ranges[0].length - 1, entry->size);
+    add_response_header(response, "Content-Range", content_range);
+    if (NULL != data)
+    {
+      set_response_body_ref(response, data + ranges[0].start, ranges[0].length, type, static_index_release, entry);
+    }
+    else
+    {
+      set_response_body_file(response, fd, ranges[0].start, ranges[0].length, type);
+      static_index_release(entry, NULL);
+    }
+  }
+  else if (1 < num_ranges)
   {
-    if ('.' == full_path[i])
+    ret = add_multipart_body(response, worker, entry, data, fd, type, ranges, num_ranges);
+    if (-1 != fd)
+    {
+      close(fd);
+    }
+    static_index_release(entry, NULL);
+    if (0 != ret)
+    {
+      // nothing has gone out yet, so the client gets no body at all rather than a truncated one
+      clear_response_headers(response);
+      clear_response_body(response);
+      if (EIO == ret)
+      {
+        // the file isn't what the index says anymore, there's no honest answer so hang up like
+        // a short sendfile does
+        response->status = -1;
+      }
+      else
+      {
+        set_response_status(response, 500, NULL);
+      }
+    }
+  }
+  else if (NULL != data)
+  {
+    // the response holds a reference to the cached body or mapping until it's been written, so
+    // nothing is copied no matter how many clients want it
+    print_debug("serving %s from memory (%zu bytes)\n", entry->path, entry->size);
+    set_response_body_ref(response, data, entry->size, type, static_index_release, entry);
+  }
+  else
+  {
+    // the file goes out with sendfile as the socket drains, and evweb closes fd once it's sent
+    print_debug("ending response with a file of size %zu, and type %s\n", entry->size, type);
+    set_response_body_file(response, fd, 0, entry->size, type);
+    static_index_release(entry, NULL);
+  }
+  end_response(response);
+}
+
+// look up path with suffix tacked on, for the precompressed copies of a file
+static evweb_static_entry* find_variant(evweb_static_index* index, int reader, unsigned long now, char* path, size_t path_length, char* suffix) {
+  char variant_path[PATH_MAX];
+  int variant_length;
+
+  variant_length = snprintf(variant_path, sizeof variant_path, "%.*s%s", (int)path_length, path, suffix);
+  if ( (variant_length < 0) || ((size_t)variant_length >= sizeof variant_path) )
+  {
+    return NULL;
+  }
+  return static_index_lookup(index, reader, now, variant_path, variant_length);
+}
+
+// Work out which parts of the file a Range header asks for. Returns how many ranges there are,
+// 0 to send the whole file and -1 when none of them are satisfiable. If-Range, a header we
+// don't understand, too many ranges or a multipart response that would be too big to build in
+// memory all mean sending the whole file.
+static int parse_ranges(evweb_request* request, evweb_static_entry* entry, static_range* ranges) {
+  char* range;
+  char* if_range;
+  char* cur_pos;
+  char* end;
+  unsigned long long first;
+  unsigned long long last;
+  size_t total = 0;
+  int num_ranges = 0;
+  bool any = false;
+
+  range = get_request_header(request, "Range");
+  if ( (NULL == range) || (0 != strncmp(range, "bytes=", strlen("bytes="))) )
+  {
+    return 0;
+  }
+  // If-Range needs a strong match, a date counts if it's exactly the one we'd send
+  if_range = get_request_header(request, "If-Range");
+  if ( (NULL != if_range) && (0 != strcmp(if_range, entry->etag)) && (0 != strcmp(if_range, entry->last_modified)) )
+  {
+    return 0;
+  }
+
+  cur_pos = range + strlen("bytes=");
+  while ('\0' != *cur_pos)
+  {
+    while ( (' ' == *cur_pos) || ('\t' == *cur_pos) || (',' == *cur_pos) )
+    {
+      cur_pos += 1;
+    }
+    if ('\0' == *cur_pos)
     {
-      extension = full_path + i + 1;
       break;
     }
+    any = true;
+
+    if ('-' == *cur_pos)
+    {
+      // a suffix range, the last so many bytes
+      last = strtoull(cur_pos + 1, &end, 10);
+      if ( (end == cur_pos + 1) || ( ('\0' != *end) && (',' != *end) && (' ' != *end) ) )
+      {
+        return 0;
+      }
+      cur_pos = end;
+      if ( (0 == last) || (0 == entry->size) )
+      {
+        continue;
+      }
+      first = (last >= entry->size) ? 0 : entry->size - last;
+      last = entry->size - 1;
+    }
+    else
+    {
+      first = strtoull(cur_pos, &end, 10);
+      if ( (end == cur_pos) || ('-' != *end) )
+      {
+        return 0;
+      }
+      cur_pos = end + 1;
+      if ( ('0' <= *cur_pos) && ('9' >= *cur_pos) )
+      {
+        last = strtoull(cur_pos, &end, 10);
+        cur_pos = end;
+        if (last < first)
+        {
+          return 0;
+        }
+      }
+      else
+      {
+        last = ULLONG_MAX;
+      }
+      if ( ('\0' != *cur_pos) && (',' != *cur_pos) && (' ' != *cur_pos) )
+      {
+        return 0;
+      }
+      if (first >= entry->size)
+      {
+        continue;
+      }
+      if (last >= entry->size)
+      {
+        last = entry->size - 1;
+      }
+    }
+
+    if (EVWEB_STATIC_MAX_RANGES == num_ranges)
+    {
+      return 0;
+    }
+    ranges[num_ranges].start = first;
+    ranges[num_ranges].length = last - first + 1;
+    total += ranges[num_ranges].length;
+    num_ranges += 1;
+  }
+
+  if (0 == num_ranges)
+  {
+    return (true == any) ? -1 : 0;
   }
-  if (0 == i)
+  if ( (1 < num_ranges) && (total > EVWEB_STATIC_MAX_MULTIPART) )
   {
-    extension = "octet-stream";
+    return 0;
   }
-  type = guess_content_type(extension);
+  return num_ranges;
+}
 
-  print_debug("ending response with a file of size %zu, and type %s\n", file_size, type);
+// Several ranges go out as multipart/byteranges, each with its own little head. The parts are
+// put together in the response body, copied from data (the cached body or mapping) or read from fd.
+// Build a multipart/byteranges body with a part for each range. Returns 0 once it's all there,
+// EIO if the file couldn't be read in full (it shrank since it was indexed) or another non-zero
+// value if the body couldn't be put together.
+static int add_multipart_body(evweb_response* response, evweb_worker* worker, evweb_static_entry* entry, char* data, int fd, char* type,
+                              static_range* ranges, int num_ranges) {
+  static unsigned int boundary_count = 0;
+  char boundary[40];
+  char content_type[80];
+  char* space;
+  ssize_t count;
+  size_t total;
+  int ret;
+  int i;
 
-  set_response_body(response, file_buffer, file_size, type);
-  end_response(response);
-  print_debug("served file %s (%zu bytes)\n", full_path, file_size);
+  // the boundary can't show up in the file, which a few random looking bytes all but guarantee
+  snprintf(boundary, sizeof boundary, "%08x%08lx%08x", worker->index, (unsigned long)(ev_now(worker->EV_A) * 1000000),
+           __atomic_add_fetch(&boundary_count, 1, __ATOMIC_RELAXED) * 2654435761u);
+  snprintf(content_type, sizeof content_type, "multipart/byteranges; boundary=%s", boundary);
+  ret = set_response_body(response, NULL, 0, content_type);
+  if (0 != ret)
+  {
+    return ret;
+  }
+
+  for (i = 0; i < num_ranges; i += 1)
+  {
+    ret = printf_response_body(response, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                               boundary, type, ranges[i].start, ranges[i].start + ranges[i].length - 1, entry->size);
+    if (0 != ret)
+    {
+      return ret;
+    }
+    if (NULL != data)
+    {
+      // each slice holds on to the cached body or mapping until it's been written
+      static_index_retain(entry);
+      ret = add_response_body_ref(response, data + ranges[i].start, ranges[i].length, static_index_release, entry);
+      if (0 != ret)
+      {
+        return ret;
+      }
+      continue;
+    }
 
-  free(file_buffer);
-  close(fd);
+    space = reserve_response_body(response, ranges[i].length);
+    if (NULL == space)
+    {
+      return (0 != errno) ? errno : -1;
+    }
+    for (total = 0; total < ranges[i].length; total += count)
+    {
+      count = pread(fd, space + total, ranges[i].length - total, ranges[i].start + total);
+      if ( (-1 == count) && (EINTR == errno) )
+      {
+        count = 0;
+        continue;
+      }
+      if (count <= 0)
+      {
+        print_err("failed to read %s for a range request: %s\n", entry->path, (0 == count) ? "file shrank" : strerror(errno));
+        return EIO;
+      }
+    }
+    ret = commit_response_body(response, ranges[i].length);
+    if (0 != ret)
+    {
+      return ret;
+    }
+  }
+  return printf_response_body(response, "\r\n--%s--\r\n", boundary);
+}
+
+// If-None-Match wins over If-Modified-Since when a client sends both
+static bool is_modified(evweb_request* request, evweb_static_entry* entry) {
+  char* if_none_match;
+  char* if_modified_since;
+  time_t since;
+
+  if_none_match = get_request_header(request, "If-None-Match");
+  if (NULL != if_none_match)
+  {
+    return (false == etag_matches(if_none_match, entry->etag));
+  }
+
+  if_modified_since = get_request_header(request, "If-Modified-Since");
+  if (NULL == if_modified_since)
+  {
+    return true;
+  }
+  // clients usually just send back what we told them, which saves parsing it
+  if (0 == strcmp(if_modified_since, entry->last_modified))
+  {
+    return false;
+  }
+  if (false == parse_http_date(if_modified_since, &since))
+  {
+    return true;
+  }
+  return (entry->mtime > since);
+}
+
+// true if etag is in the If-None-Match list. The weak comparison is the one to use here, so a
+// W/ prefix makes no difference
+static bool etag_matches(char* if_none_match, char* etag) {
+  size_t etag_length = strlen(etag);
+  char* cur_pos = if_none_match;
+  char* token;
+
+  while ('\0' != *cur_pos)
+  {
+    while ( (' ' == *cur_pos) || ('\t' == *cur_pos) || (',' == *cur_pos) )
+    {
+      cur_pos += 1;
+    }
+    if ('*' == *cur_pos)
+    {
+      return true;
+    }
+    if ( ('W' == cur_pos[0]) && ('/' == cur_pos[1]) )
+    {
+      cur_pos += 2;
+    }
+    token = cur_pos;
+    while ( ('\0' != *cur_pos) && (',' != *cur_pos) && (' ' != *cur_pos) && ('\t' != *cur_pos) )
+    {
+      cur_pos += 1;
+    }
+    if ( ((size_t)(cur_pos - token) == etag_length) && (0 == memcmp(token, etag, etag_length)) )
+    {
+      return true;
+    }
+  }
+  return false;
 }
 
 static char* guess_content_type(char* extension) {
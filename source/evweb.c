@@ -2,10 +2,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
 
 #include <evn.h>
 
 #include "evweb.h"
+#include "body-segment.h"
+#include "compress-filter.h"
+#include "processer-pool.h"
+#include "response-writer.h"
 #include "tcp-server.h"
 
 #ifndef DEBUG_EVWEB
@@ -24,31 +30,72 @@
 #define print_status(...) printf("[evweb] " __VA_ARGS__)
 #define print_err(...) fprintf(stderr, "[evweb] " __VA_ARGS__)
 
-static evweb_on_connection* request_handler;
-static evweb_server_settings* server_settings;
-
-static void close_connection_on_drain(EV_P, struct evn_stream* stream);
+static int copy_body_ref(evweb_worker* worker, evweb_response* response);
 
 int interpret_header(evweb_http_processer* parser) {
+  evweb_exchange* exchange = parser->last_exchange;
+
   print_debug("header finished, reading in select values\n");
-  parser->request.method = parser->parser.method;
+  exchange->request.method = parser->parser.method;
+  exchange->http_major = parser->parser.http_major;
+  exchange->http_minor = parser->parser.http_minor;
   print_debug("header processing finished\n");
   return 0;
 }
 
 int finish_message(evweb_http_processer* parser) {
+  evweb_exchange* exchange = parser->last_exchange;
+  int max_requests = parser->worker->server->settings->max_requests;
+
+  exchange->complete = true;
+  if (true == parser->closing)
+  {
+    // an earlier request on this connection is its last, so nobody will see this response
+    print_debug("dropping pipelined request received after the connection's last one\n");
+    exchange->ended = true;
+    return 0;
+  }
+
+  // decide now whether the connection outlives this request, the parser will have moved on to
+  // the next message by the time an asynchronous handler calls end_response
+  parser->num_requests += 1;
+  exchange->keep_alive = (0 != http_should_keep_alive(&(parser->parser)));
+  if ( (max_requests > 0) && (parser->num_requests >= max_requests) )
+  {
+    print_debug("connection has served %d requests, closing after this one\n", parser->num_requests);
+    exchange->keep_alive = false;
+  }
+  if (false == exchange->keep_alive)
+  {
+    parser->closing = true;
+  }
+
   print_debug("message finished, sending to handler\n");
-  request_handler(&(parser->request), &(parser->response));
+  parser->worker->server->request_handler(&(exchange->request), &(exchange->response));
   print_debug("message handling finished\n");
   return 0;
 }
 
+// the value of the first request header named field, or NULL if the client didn't send one
+char* get_request_header(evweb_request* request, char* field) {
+  int i;
+
+  for (i = 0; i < request->num_header_lines; i += 1)
+  {
+    if (0 == strcasecmp(request->header_lines[i].field, field))
+    {
+      return request->header_lines[i].value;
+    }
+  }
+  return NULL;
+}
+
 int set_response_status(evweb_response* response, int status, char* message) {
   response->status = status;
 
   if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
   {
-    print_err("trying to set response status on a connection that has already ended (%s)\n", ((evweb_http_processer*)(response->connection->send_data))->request.url);
+    print_err("trying to set response status on a connection that has already ended (%s)\n", response->exchange->request.url);
     return -1;
   }
 
@@ -77,7 +124,7 @@ int add_response_header(evweb_response* response, char* field, char* value) {
 
   if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
   {
-    print_err("trying to add to response headers on a connection that has already ended (%s)\n", ((evweb_http_processer*)(response->connection->send_data))->request.url);
+    print_err("trying to add to response headers on a connection that has already ended (%s)\n", response->exchange->request.url);
     return -1;
   }
 
@@ -147,7 +194,7 @@ int clear_response_headers(evweb_response* response) {
 
   if (evn_CLOSED == (response->connection)->ready_state)
   {
-    print_err("trying to clear headers on a connection that has already ended (%s)\n", ((evweb_http_processer*)(response->connection->send_data))->request.url);
+    print_err("trying to clear headers on a connection that has already ended (%s)\n", response->exchange->request.url);
     return -1;
   }
 
@@ -169,7 +216,7 @@ int set_response_body(evweb_response* response, void* body, size_t body_length,
 
   if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
   {
-    print_err("trying to set response body on a connection that has already ended (%s)\n", ((evweb_http_processer*)(response->connection->send_data))->request.url);
+    print_err("trying to set response body on a connection that has already ended (%s)\n", response->exchange->request.url);
     return -1;
   }
 
@@ -177,30 +224,193 @@ int set_response_body(evweb_response* response, void* body, size_t body_length,
   return add_to_response_body(response, body, body_length, type);
 }
 
+int set_response_body_ref(evweb_response* response, void* body, size_t body_length, char* type, evweb_release_cb* release, void* ctx) {
+  int ret;
+
+  if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
+  {
+    print_err("trying to set response body on a connection that has already ended (%s)\n", response->exchange->request.url);
+    if (NULL != release)
+    {
+      release(ctx, body);
+    }
+    return -1;
+  }
+
+  clear_response_body(response);
+  ret = add_to_response_body(response, NULL, 0, type);
+
+  // even when setting the type failed the body is ours to hand back now
+  response->body_ref = body;
+  response->body_release = release;
+  response->body_release_ctx = ctx;
+  response->content_length = body_length;
+  return ret;
+}
+
+int add_response_body_ref(evweb_response* response, void* body, size_t body_length, evweb_release_cb* release, void* ctx) {
+  evweb_worker* worker;
+  evweb_body_segment* segment;
+  int ret;
+
+  if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
+  {
+    print_err("trying to add to response body on a connection that has already ended (%s)\n", response->exchange->request.url);
+    if (NULL != release)
+    {
+      release(ctx, body);
+    }
+    return -1;
+  }
+
+  // the lent bytes become a segment of their own, so what's around them is kept as it is
+  worker = ((evweb_http_processer*)response->connection->send_data)->worker;
+  segment = NULL;
+  if (0 == copy_body_ref(worker, response))
+  {
+    segment = lend_segment(body, body_length, release, ctx);
+  }
+  if (NULL == segment)
+  {
+    ret = errno;
+    if (NULL != release)
+    {
+      release(ctx, body);
+    }
+    return ret;
+  }
+
+  if (NULL == response->body_last)
+  {
+    response->body = segment;
+  }
+  else
+  {
+    response->body_last->next = segment;
+  }
+  response->body_last = segment;
+  response->content_length += body_length;
+  return 0;
+}
+
+int set_response_body_file(evweb_response* response, int fd, off_t offset, size_t body_length, char* type) {
+  int ret;
+
+  if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
+  {
+    print_err("trying to set response body on a connection that has already ended (%s)\n", response->exchange->request.url);
+    close(fd);
+    return -1;
+  }
+
+  clear_response_body(response);
+  ret = add_to_response_body(response, NULL, 0, type);
+
+  response->body_fd = fd;
+  response->body_fd_offset = offset;
+  response->content_length = body_length;
+  return ret;
+}
+
+int set_response_length(evweb_response* response, size_t body_length, char* type) {
+  int ret;
+
+  if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
+  {
+    print_err("trying to set response length on a connection that has already ended (%s)\n", response->exchange->request.url);
+    return -1;
+  }
+
+  clear_response_body(response);
+  ret = add_to_response_body(response, NULL, 0, type);
+
+  response->content_length = body_length;
+  return ret;
+}
+
+// A lent body can't be added to, so the first time a handler appends to one we copy it into
+// segments like any other body and give it back.
+static int copy_body_ref(evweb_worker* worker, evweb_response* response) {
+  void* body = response->body_ref;
+  size_t body_length = response->content_length;
+  char* space;
+
+  if (-1 != response->body_fd)
+  {
+    print_err("a file body can't be added to (%s)\n", response->exchange->request.url);
+    return -1;
+  }
+  if (NULL == body)
+  {
+    return 0;
+  }
+
+  space = reserve_body_space(worker, response, body_length);
+  if (NULL == space)
+  {
+    print_err("failed to allocate memory to copy the response body: %s\n", strerror(errno));
+    return errno;
+  }
+  memcpy(space, body, body_length);
+  response->body_last->length += body_length;
+
+  if (NULL != response->body_release)
+  {
+    response->body_release(response->body_release_ctx, body);
+  }
+  response->body_ref = NULL;
+  response->body_release = NULL;
+  response->body_release_ctx = NULL;
+  return 0;
+}
+
 int add_to_response_body(evweb_response* response, void* body, size_t body_length, char* type) {
-  size_t current_length;
+  evweb_worker* worker;
+  evweb_body_segment* segment;
+  size_t length;
+  char* space;
 
   if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
   {
-    print_err("trying to add to response body on a connection that has already ended (%s)\n", ((evweb_http_processer*)(response->connection->send_data))->request.url);
+    print_err("trying to add to response body on a connection that has already ended (%s)\n", response->exchange->request.url);
     return -1;
   }
 
   if(body_length > 0)
   {
     print_debug("received %zu bytes of data to place in the body:\n", body_length);
-
-    current_length = response->content_length;
-    response->content_length += body_length;
-    response->content = realloc(response->content, response->content_length);
-
-    if (NULL == response->content)
+    worker = ((evweb_http_processer*)response->connection->send_data)->worker;
+    if (0 != copy_body_ref(worker, response))
     {
-      print_err("failed to reallocate memory for response body: %s\n", strerror(errno));
       return errno;
     }
-    print_debug("loading the body data into the response object (address %p)\n", response->content);
-    memcpy(response->content + current_length, body, body_length);
+
+    // top off the last segment, then spill whatever is left into fresh ones
+    while (body_length > 0)
+    {
+      segment = response->body_last;
+      if ( (NULL == segment) || (segment->length == segment->capacity) )
+      {
+        if (NULL == reserve_body_space(worker, response, 1))
+        {
+          print_err("failed to allocate memory for response body: %s\n", strerror(errno));
+          return errno;
+        }
+        segment = response->body_last;
+      }
+
+      length = segment->capacity - segment->length;
+      if (length > body_length)
+      {
+        length = body_length;
+      }
+      space = segment->data + segment->length;
+      memcpy(space, body, length);
+      segment->length += length;
+      response->content_length += length;
+      body = (char*)body + length;
+      body_length -= length;
+    }
   }
 
   if ( (NULL != type) && (strlen(type) > 0) )
@@ -227,15 +437,31 @@ int clear_response_body(evweb_response* response) {
 
   if (evn_CLOSED == (response->connection)->ready_state)
   {
-    print_err("trying to clear body on a connection that has already ended (%s)\n", ((evweb_http_processer*)(response->connection->send_data))->request.url);
+    print_err("trying to clear body on a connection that has already ended (%s)\n", response->exchange->request.url);
     return -1;
   }
   response->content_length = 0;
 
-  if (NULL != response->content)
+  if (NULL != response->body)
+  {
+    release_segment_chain(((evweb_http_processer*)response->connection->send_data)->worker, response->body);
+    response->body = NULL;
+    response->body_last = NULL;
+  }
+  if (NULL != response->body_ref)
+  {
+    if (NULL != response->body_release)
+    {
+      response->body_release(response->body_release_ctx, response->body_ref);
+    }
+    response->body_ref = NULL;
+    response->body_release = NULL;
+    response->body_release_ctx = NULL;
+  }
+  if (-1 != response->body_fd)
   {
-    free(response->content);
-    response->content = NULL;
+    close(response->body_fd);
+    response->body_fd = -1;
   }
 
   if (NULL != response->content_type)
@@ -247,20 +473,92 @@ int clear_response_body(evweb_response* response) {
   return 0;
 }
 
-bool send_response(evweb_response* response) {
-  struct evn_stream* stream = response->connection;
-  char header[1024 + 128 * response->num_header_lines];
-  size_t header_length = 0;
-  char* message;
+void* reserve_response_body(evweb_response* response, size_t length) {
+  evweb_worker* worker;
 
-  int i;
-  evweb_header_line* current_line;
+  if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
+  {
+    print_err("trying to reserve response body on a connection that has already ended (%s)\n", response->exchange->request.url);
+    return NULL;
+  }
+
+  worker = ((evweb_http_processer*)response->connection->send_data)->worker;
+  if (0 != copy_body_ref(worker, response))
+  {
+    return NULL;
+  }
+  return reserve_body_space(worker, response, length);
+}
+
+int commit_response_body(evweb_response* response, size_t length) {
+  evweb_body_segment* segment = response->body_last;
+
+  if ( (NULL == segment) || (segment->capacity - segment->length < length) )
+  {
+    print_err("trying to commit %zu bytes more than was reserved (%s)\n", length, response->exchange->request.url);
+    return -1;
+  }
+
+  segment->length += length;
+  response->content_length += length;
+  return 0;
+}
+
+// format straight into the body. We guess the output fits in what's left of the last segment,
+// and only when it doesn't do we reserve exactly enough and format a second time.
+int printf_response_body(evweb_response* response, const char* format, ...) {
+  va_list args;
+  evweb_body_segment* segment;
+  char* space;
+  size_t room = 0;
+  int length;
+
+  if ( (evn_CLOSED == (response->connection)->ready_state) || (evn_READ_ONLY == (response->connection)->ready_state) )
+  {
+    print_err("trying to print to response body on a connection that has already ended (%s)\n", response->exchange->request.url);
+    return -1;
+  }
+
+  segment = response->body_last;
+  space = NULL;
+  if (NULL != segment)
+  {
+    space = segment->data + segment->length;
+    room = segment->capacity - segment->length;
+  }
+
+  va_start(args, format);
+  length = vsnprintf(space, room, format, args);
+  va_end(args);
+  if (length < 0)
+  {
+    print_err("failed to format response body: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // vsnprintf needs room for the NUL it writes even though the body doesn't keep it
+  if ((size_t)length >= room)
+  {
+    space = reserve_response_body(response, length + 1);
+    if (NULL == space)
+    {
+      return errno;
+    }
+    va_start(args, format);
+    vsnprintf(space, length + 1, format, args);
+    va_end(args);
+  }
 
-  bool finished = false;
+  return commit_response_body(response, length);
+}
+
+bool send_response(evweb_response* response) {
+  struct evn_stream* stream = response->connection;
+  evweb_http_processer* processer = (evweb_http_processer*)stream->send_data;
 
   if ( (evn_CLOSED == stream->ready_state) || (evn_READ_ONLY == stream->ready_state) )
   {
-    print_err("trying to send response on a connection that has already ended (%s)\n", ((evweb_http_processer*)(response->connection->send_data))->request.url);
+    print_err("trying to send response on a connection that has already ended (%s)\n", response->exchange->request.url);
     return false;
   }
 
@@ -270,172 +568,304 @@ bool send_response(evweb_response* response) {
     return false;
   }
 
-  if (NULL == response->status_message)
+  if ( (false == response->exchange->streaming) && (0 != compress_response(response->exchange, response)) )
   {
-    switch (response->status)
-    {
-      case 100:
-        message = "Continue";
-        break;
-      case 101:
-        message = "Switching Protocols";
-        break;
-      case 200:
-        message = "OK";
-        break;
-      case 201:
-        message = "Created";
-        break;
-      case 202:
-        message = "Accepted";
-        break;
-      case 203:
-        message = "Non-Authoritative Information";
-        break;
-      case 204:
-        message = "No Content";
-        break;
-      case 205:
-        message = "Reset Content";
-        break;
-      case 206:
-        message = "Partial Content";
-        break;
-      case 400:
-        message = "Bad Request";
-        break;
-      case 401:
-        message = "Unauthorized";
-        break;
-      case 402:
-        message = "Payment Required";
-        break;
-      case 403:
-        message = "Forbidden";
-        break;
-      case 404:
-        message = "Not Found";
-        break;
-      case 503:
-        message = "Service Unavailable";
-        break;
-
-      default:
-        message = "\0";
-    }
+    return false;
   }
-  else
+  if (0 != queue_response(response->exchange, response))
   {
-    message = response->status_message;
+    return false;
   }
 
-  header_length += snprintf(header + header_length, (sizeof header) - header_length, "HTTP/1.1 %d %s\r\n", response->status, message);
+  clear_response_body(response);
+  clear_response_headers(response);
+  free(response->status_message);
+  response->status_message = NULL;
+  response->status = -1;
 
-  current_line = response->header_lines;
-  for (i = 0; i < response->num_header_lines; i += 1)
+  // responses produced while a read is being parsed go out together once it's done
+  if (true == processer->defer_flush)
   {
-    header_length += snprintf(header + header_length, (sizeof header) - header_length, "%s: %s\r\n", current_line->field, current_line->value);
-    current_line += 1;
+    return false;
   }
+  return flush_exchanges(processer);
+}
+
+static void add_connection_header(evweb_response* response) {
+  evweb_exchange* exchange = response->exchange;
 
-  if (response->content_length > 0)
+  if (true == exchange->keep_alive)
   {
-    header_length += snprintf(header + header_length, (sizeof header) - header_length, "Content-Length: %zu\r\n", response->content_length);
+    // HTTP/1.1 connections are persistent unless told otherwise, 1.0 clients need it spelled out
+    if ( (1 == exchange->http_major) && (0 == exchange->http_minor) )
+    {
+      add_response_header(response, "Connection", "keep-alive");
+    }
   }
-  if (NULL != response->content_type)
+  else
   {
-    header_length += snprintf(header + header_length, (sizeof header) - header_length, "Content-Type: %s\r\n", response->content_type);
+    add_response_header(response, "Connection", "close");
   }
+}
 
-  header_length += snprintf(header + header_length, (sizeof header) - header_length, "\r\n");
+// queue the response's head without flushing, the caller decides when it can go
+static void queue_head(evweb_http_processer* processer, evweb_response* response) {
+  bool defer_flush;
 
-  if ( (header_length >= sizeof header) || (header_length != strlen(header)) )
+  defer_flush = processer->defer_flush;
+  processer->defer_flush = true;
+  send_response(response);
+  processer->defer_flush = defer_flush;
+}
+
+// write out whatever is ready, unless we're in the middle of parsing a read
+static int flush_response(evweb_http_processer* processer, struct evn_stream* stream) {
+  bool finished;
+
+  if (true == processer->defer_flush)
   {
-    print_err("header length (%zu) and the string length of header (%zu) don't match\n", header_length, strlen(header));
-    print_debug("%s", header);
+    print_debug("response queued, it will be written once the current read is parsed\n");
+    return 1;
   }
 
-  finished = evn_stream_write(stream->EV_A, stream, header, strlen(header));
-
+  finished = flush_exchanges(processer);
   if (evn_CLOSED == stream->ready_state)
   {
-    print_err("connection closed while writing headers to stream\n");
-    return false;
+    print_err("connection closed while sending data\n");
+    return -1;
+  }
+  return (true == finished) ? 0 : 1;
+}
+
+// queue part of a streamed body, framed as a chunk if the client understands them
+static int queue_stream_data(evweb_exchange* exchange, void* data, size_t length) {
+  // an empty chunk would tell the client the body is over
+  if ( (0 == length) || (true == exchange->bodiless) )
+  {
+    return 0;
   }
 
-  if (response->content_length > 0)
+  if (true == exchange->chunked)
   {
-    finished = evn_stream_write(stream->EV_A, stream, response->content, response->content_length);
-    if (evn_CLOSED == stream->ready_state)
-    {
-      print_err("connection closed while writing body to stream\n");
-      return false;
-    }
+    return queue_chunk(exchange, data, length);
   }
+  return queue_output(exchange, data, length);
+}
 
-  clear_response_body(response);
-  clear_response_headers(response);
-  free(response->status_message);
-  response->status_message = NULL;
-  response->status = -1;
+// queue a file as part of a streamed body, the fd is closed once it has been sent
+static int queue_stream_file(evweb_exchange* exchange, int fd, off_t offset, size_t length) {
+  char size[32];
+  int ret;
+
+  if ( (0 == length) || (true == exchange->bodiless) )
+  {
+    close(fd);
+    return 0;
+  }
+  if (false == exchange->chunked)
+  {
+    return queue_file(exchange, fd, offset, length);
+  }
 
-  return finished;
+  snprintf(size, sizeof size, "%zx\r\n", length);
+  ret = queue_output(exchange, size, strlen(size));
+  if (0 != ret)
+  {
+    close(fd);
+    return ret;
+  }
+  ret = queue_file(exchange, fd, offset, length);
+  if (0 != ret)
+  {
+    return ret;
+  }
+  return queue_output(exchange, "\r\n", 2);
 }
 
 int end_response(evweb_response* response) {
   struct evn_stream* stream = response->connection;
-  bool finished;
+  evweb_http_processer* processer = (evweb_http_processer*)stream->send_data;
+  evweb_exchange* exchange = response->exchange;
 
   if ( (evn_CLOSED == stream->ready_state) || (evn_READ_ONLY == stream->ready_state) )
   {
-    print_err("trying to end response that has already ended (%s)\n", ((evweb_http_processer*)(response->connection->send_data))->request.url);
+    print_err("trying to end response that has already ended (%s)\n", exchange->request.url);
     return -1;
   }
 
+  if (true == exchange->streaming)
+  {
+    return evweb_response_end_chunked(response);
+  }
+
   if (-1 == response->status)
   {
-    finished = true;
+    // there is nothing to tell the client, so the only way to finish is to hang up
+    exchange->keep_alive = false;
+    processer->closing = true;
   }
   else
   {
-    add_response_header(response, "Connection", "close");
-    finished = send_response(response);
+    add_connection_header(response);
+    // the exchange has to be marked ended before anything is flushed
+    queue_head(processer, response);
   }
+  exchange->ended = true;
 
-  if (evn_CLOSED == stream->ready_state)
+  return flush_response(processer, stream);
+}
+
+int evweb_response_begin_chunked(evweb_response* response) {
+  struct evn_stream* stream = response->connection;
+  evweb_http_processer* processer = (evweb_http_processer*)stream->send_data;
+  evweb_exchange* exchange = response->exchange;
+  evweb_body_segment* body;
+  evweb_body_segment* segment;
+  int body_fd;
+  off_t body_fd_offset;
+  size_t body_fd_length;
+  int ret;
+
+  if ( (evn_CLOSED == stream->ready_state) || (evn_READ_ONLY == stream->ready_state) )
+  {
+    print_err("trying to stream a response on a connection that has already ended (%s)\n", exchange->request.url);
+    return -1;
+  }
+  if ( (-1 == response->status) || (true == exchange->streaming) || (true == exchange->ended) )
   {
-    print_err("connection closed while sending data (%s)\n", ((evweb_http_processer*)(response->connection->send_data))->request.url);
+    print_err("can only start streaming a response that has a status and hasn't been sent (%s)\n", exchange->request.url);
     return -1;
   }
 
-  if (true == finished)
+  exchange->streaming = true;
+  // anything written after the head would be read as the start of the next response
+  exchange->bodiless = ( (HTTP_HEAD == exchange->request.method) || (response->status < 200) ||
+                         (204 == response->status) || (304 == response->status) );
+  if ( (response->status >= 200) && (204 != response->status) && (304 != response->status) )
   {
-    print_debug("closing connection\n");
-    evn_stream_end(stream->EV_A, stream);
-    return 0;
+    if ( (exchange->http_major > 1) || ( (1 == exchange->http_major) && (exchange->http_minor >= 1) ) )
+    {
+      // HEAD says chunked too, because that's how the body of a GET would come
+      exchange->chunked = true;
+    }
+    else if (false == exchange->bodiless)
+    {
+      // 1.0 clients don't know chunks, the end of the body is the end of the connection
+      exchange->keep_alive = false;
+      processer->closing = true;
+    }
   }
-  else
+  add_connection_header(response);
+
+  // whatever body was set before we started streaming goes out as the first chunks
+  ret = 0;
+  body_fd = response->body_fd;
+  body_fd_offset = response->body_fd_offset;
+  body_fd_length = response->content_length;
+  response->body_fd = -1;
+  if (-1 == body_fd)
   {
-    print_debug("did not send all data, will end connection on drain\n");
-    stream->on_drain = close_connection_on_drain;
-    return 1;
+    ret = copy_body_ref(processer->worker, response);
+  }
+  body = response->body;
+  response->body = NULL;
+  response->body_last = NULL;
+  response->content_length = 0;
+
+  queue_head(processer, response);
+  for (segment = body; (NULL != segment) && (0 == ret); segment = segment->next)
+  {
+    ret = queue_stream_data(exchange, segment_bytes(segment), segment->length);
+  }
+  release_segment_chain(processer->worker, body);
+  if (-1 != body_fd)
+  {
+    ret = queue_stream_file(exchange, body_fd, body_fd_offset, body_fd_length);
+  }
+  if (0 != ret)
+  {
+    return -1;
+  }
+
+  return flush_response(processer, stream);
+}
+
+int evweb_response_write_chunk(evweb_response* response, void* data, size_t length) {
+  struct evn_stream* stream = response->connection;
+  evweb_http_processer* processer = (evweb_http_processer*)stream->send_data;
+  evweb_exchange* exchange = response->exchange;
+
+  if ( (evn_CLOSED == stream->ready_state) || (evn_READ_ONLY == stream->ready_state) )
+  {
+    print_err("trying to write a chunk on a connection that has already ended (%s)\n", exchange->request.url);
+    return -1;
+  }
+  if ( (false == exchange->streaming) || (true == exchange->ended) )
+  {
+    print_err("trying to write a chunk to a response that isn't streaming (%s)\n", exchange->request.url);
+    return -1;
   }
+
+  if (0 != queue_stream_data(exchange, data, length))
+  {
+    return -1;
+  }
+
+  return flush_response(processer, stream);
 }
 
-void evweb_start_server(EV_P, int port, evweb_server_settings* settings, evweb_on_connection callback) {
-  request_handler = callback;
-  server_settings = settings;
+int evweb_response_end_chunked(evweb_response* response) {
+  struct evn_stream* stream = response->connection;
+  evweb_http_processer* processer = (evweb_http_processer*)stream->send_data;
+  evweb_exchange* exchange = response->exchange;
+
+  if ( (evn_CLOSED == stream->ready_state) || (evn_READ_ONLY == stream->ready_state) )
+  {
+    print_err("trying to end a streamed response on a connection that has already ended (%s)\n", exchange->request.url);
+    return -1;
+  }
+  if ( (false == exchange->streaming) || (true == exchange->ended) )
+  {
+    print_err("trying to end a response that isn't streaming (%s)\n", exchange->request.url);
+    return -1;
+  }
+
+  if ( (true == exchange->chunked) && (false == exchange->bodiless) )
+  {
+    if (0 != queue_output(exchange, "0\r\n\r\n", 5))
+    {
+      return -1;
+    }
+  }
+  exchange->ended = true;
 
-  start_tcp_server(EV_A, port, settings);
+  return flush_response(processer, stream);
 }
 
-void evweb_close_server() {
-  close_tcp_server();
+evweb_server* evweb_start_server(EV_P, int port, evweb_server_settings* settings, evweb_on_connection callback, void* data) {
+  evweb_server* server;
+
+  server = calloc(1, sizeof (evweb_server));
+  if (NULL == server)
+  {
+    print_err("failed to allocate memory for the server: %s\n", strerror(errno));
+    return NULL;
+  }
+  server->request_handler = callback;
+  server->settings = settings;
+  server->data = data;
+  server->port = port;
+
+  if (0 != start_tcp_server(EV_A, server))
+  {
+    free(server);
+    return NULL;
+  }
+  return server;
 }
 
-static void close_connection_on_drain(EV_P, struct evn_stream* stream) {
-  print_debug("all data sent, we can now close connection\n");
-  evn_stream_end(stream->EV_A, stream);
+void evweb_close_server(evweb_server* server) {
+  close_tcp_server(server);
 }
 
 char* query_to_json(char* in_query, char* out_json, size_t json_size) {
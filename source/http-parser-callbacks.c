@@ -7,6 +7,8 @@
 
 #include "http_parser.h"
 #include "evweb.h"
+#include "arena.h"
+#include "processer-pool.h"
 
 #ifndef DEBUG_HTTP_PARSER_CBS
   #ifdef DEBUG
@@ -24,9 +26,6 @@
 #define print_status(...) printf("[http-parser-cbs] " __VA_ARGS__)
 #define print_err(...) fprintf(stderr, "[http-parser-cbs] " __VA_ARGS__)
 
-static http_parser_settings parser_settings;
-static bool cbs_initialized = false;
-
 static int on_message_begin(http_parser* parser);
 static int on_url(http_parser* parser, const char* at, size_t length);
 static int on_header_field(http_parser* parser, const char* at, size_t length);
@@ -35,106 +34,95 @@ static int on_headers_complete(http_parser* parser);
 static int on_body(http_parser* parser, const char* at, size_t length);
 static int on_message_complete(http_parser* parser);
 
-http_parser_settings* get_http_parser_settings() {
-  if (true != cbs_initialized)
-  {
-    parser_settings.on_message_begin = on_message_begin;
-    parser_settings.on_url = on_url;
-    parser_settings.on_header_field = on_header_field;
-    parser_settings.on_header_value = on_header_value;
-    parser_settings.on_headers_complete = on_headers_complete;
-    parser_settings.on_body = on_body;
-    parser_settings.on_message_complete = on_message_complete;
-    cbs_initialized = true;
-  }
+// initialized statically so worker threads never race to fill it in
+static http_parser_settings parser_settings = {
+  .on_message_begin = on_message_begin,
+  .on_url = on_url,
+  .on_header_field = on_header_field,
+  .on_header_value = on_header_value,
+  .on_headers_complete = on_headers_complete,
+  .on_body = on_body,
+  .on_message_complete = on_message_complete,
+};
 
+http_parser_settings* get_http_parser_settings() {
   return &parser_settings;
 }
 
 static int on_message_begin(http_parser* parser) {
-  int i;
-  evweb_header_line* current_line;
   evweb_http_processer* processer = (evweb_http_processer*)parser;
   print_debug("message begun\n");
 
-  // set last_was_value true so we will properly read in the first header
-  processer->request.last_was_value = true;
-
-  // these will be calloced, so it is safe to free pointer we didn't set (they will be NULL)
-  // we still want to reinitialize them incase we get another message on the same connection
-  current_line = processer->request.header_lines;
-  for (i = 0; i < processer->request.num_header_lines; i += 1)
+  // every message gets an exchange of its own at the back of the connection's queue. Pooled
+  // exchanges come with a rewound arena, so the request's strings cost no allocation
+  if (NULL == acquire_exchange(processer))
   {
-    free(current_line->field);
-    free(current_line->value);
-    current_line += 1;
+    return 1;
   }
-  free(processer->request.header_lines);
 
-  processer->request.num_header_lines = 0;
-  processer->request.max_num_header_lines = 10;
-  processer->request.header_lines = calloc(processer->request.max_num_header_lines, sizeof(evweb_header_line));
+  print_debug("request struct initialized\n");
 
-  free(processer->request.url);
-  processer->request.url = NULL;
-  processer->request.url_length = 0;
+  return 0;
+}
 
-  free(processer->request.body);
-  processer->request.body = NULL;
-  processer->request.body_length = 0;
+// append a fragment to a string, moving it into the arena first if it isn't already there
+static char* append_to_arena_string(evweb_arena* arena, char* str, size_t* str_len, const char* at, size_t length) {
+  str = arena_extend(arena, str, (NULL == str) ? 0 : *str_len, *str_len + length + 1);
+  if (NULL == str)
+  {
+    return NULL;
+  }
+  memcpy(str + *str_len, at, length);
+  *str_len += length;
+  str[*str_len] = '\0';
 
-  // Now initialize the response and it's headers
-  processer->response.status = -1;
-  free(processer->response.status_message);
-  processer->response.status_message = NULL;
+  return str;
+}
 
-  current_line = processer->response.header_lines;
-  for (i = 0; i < processer->response.num_header_lines; i += 1)
+// Point a token straight into the read buffer when the whole thing arrived in this read. The
+// parser has already consumed the delimiter right after the token (the space after the url,
+// the ':' after a field, the CR after a value), so we can overwrite it with the terminator
+// and hand out an ordinary C string without copying. A token that runs to the end of the
+// buffer might continue in the next read, so that one is copied into the arena instead, and
+// so is a token we already started (it straddles two reads and needs compacting), and every
+// token when the buffer can't be held on to.
+static char* take_token(evweb_http_processer* processer, evweb_exchange* exchange, char* str, size_t* str_len, const char* at, size_t length) {
+  char* view;
+
+  if ( (NULL == str) && (false == processer->copy_tokens) && (at + length < processer->input_end) )
   {
-    free(current_line->field);
-    free(current_line->value);
-    current_line += 1;
+    view = processer->input_start + (at - processer->input_start);
+    view[length] = '\0';
+    *str_len = length;
+    processer->input_held = true;
+    return view;
   }
-  free(processer->response.header_lines);
-  processer->response.num_header_lines = 0;
-  processer->response.max_num_header_lines = 5;
-  processer->response.header_lines = calloc(processer->response.max_num_header_lines, sizeof(evweb_header_line));
-
-  free(processer->response.content);
-  processer->response.content = NULL;
-  free(processer->response.content_type);
-  processer->response.content_type = NULL;
-  processer->response.content_length = 0;
-  processer->response.connection = (struct evn_stream*)parser->data;
-
-  print_debug("request struct initialized\n");
 
-  return 0;
+  return append_to_arena_string(&(exchange->arena), str, str_len, at, length);
 }
 
 static int on_url(http_parser* parser, const char* at, size_t length) {
   evweb_http_processer* processer = (evweb_http_processer*)parser;
-  size_t current_len = processer->request.url_length;
+  evweb_request* request = &(processer->last_exchange->request);
 
   print_debug("url received: %.*s\n", (int)length, at);
 
-  processer->request.url_length += length;
-  processer->request.url = realloc(processer->request.url, processer->request.url_length + 1);
-  if (NULL == processer->request.url)
+  request->url = take_token(processer, processer->last_exchange, request->url, &(request->url_length), at, length);
+  if (NULL == request->url)
   {
-    print_err("failed to realloc memory for the url: %s\n", strerror(errno));
+    print_err("failed to allocate memory for the url: %s\n", strerror(errno));
     return 1;
   }
-  memcpy(processer->request.url + current_len, at, length);
-  processer->request.url[processer->request.url_length] = '\0';
 
-  return http_parser_parse_url(processer->request.url, processer->request.url_length, 0, &(processer->request.parsed_url_info));
+  return 0;
 }
 
 static int on_header_field(http_parser* parser, const char* at, size_t length) {
   evweb_header_line* current_line;
-  size_t current_length;
-  evweb_request* request = &(((evweb_http_processer*)parser)->request);
+  evweb_http_processer* processer = (evweb_http_processer*)parser;
+  evweb_exchange* exchange = processer->last_exchange;
+  evweb_request* request = &(exchange->request);
+  int max_num_header_lines;
 
   print_debug("header field received: %.*s\n", (int)length, at);
 
@@ -144,14 +132,17 @@ static int on_header_field(http_parser* parser, const char* at, size_t length) {
     request->num_header_lines += 1;
     if (request->num_header_lines > request->max_num_header_lines)
     {
-      request->max_num_header_lines *= 2;
-      print_debug("expanding the number of headers we can store to %d\n", request->max_num_header_lines);
-      request->header_lines = realloc(request->header_lines, request->max_num_header_lines * sizeof (evweb_header_line));
+      max_num_header_lines = (0 == request->max_num_header_lines) ? 16 : request->max_num_header_lines * 2;
+      print_debug("expanding the number of headers we can store to %d\n", max_num_header_lines);
+      request->header_lines = arena_extend(&(exchange->arena), request->header_lines,
+                                           request->max_num_header_lines * sizeof (evweb_header_line),
+                                           max_num_header_lines * sizeof (evweb_header_line));
       if (NULL == request->header_lines)
       {
         print_err("failed to allocate memory to expand the number of headers we can store: %s\n", strerror(errno));
         return 1;
       }
+      request->max_num_header_lines = max_num_header_lines;
     }
     current_line = request->header_lines + request->num_header_lines - 1;
     memset(current_line, 0, sizeof (evweb_header_line));
@@ -162,11 +153,12 @@ static int on_header_field(http_parser* parser, const char* at, size_t length) {
     print_debug("previous (incomplete) header field = %s\n", current_line->field);
   }
 
-  current_length = current_line->field_len;
-  current_line->field_len += length;
-  current_line->field = realloc(current_line->field, current_line->field_len+1);
-  memcpy(current_line->field + current_length, at, length);
-  current_line->field[current_line->field_len] = '\0';
+  current_line->field = take_token(processer, exchange, current_line->field, &(current_line->field_len), at, length);
+  if (NULL == current_line->field)
+  {
+    print_err("failed to allocate memory for the header field: %s\n", strerror(errno));
+    return 1;
+  }
 
   request->last_was_value = false;
   return 0;
@@ -174,50 +166,58 @@ static int on_header_field(http_parser* parser, const char* at, size_t length) {
 
 static int on_header_value(http_parser* parser, const char* at, size_t length) {
   evweb_header_line* current_line;
-  size_t current_length;
   evweb_http_processer* processer = (evweb_http_processer*)parser;
+  evweb_exchange* exchange = processer->last_exchange;
 
   print_debug("header value received: %.*s\n", (int)length, at);
 
-  current_line = processer->request.header_lines + processer->request.num_header_lines - 1;
+  current_line = exchange->request.header_lines + exchange->request.num_header_lines - 1;
 
-  if (true == processer->request.last_was_value)
+  if (true == exchange->request.last_was_value)
   {
     print_debug("adding %zu to the header value buffer currently size %zu\n", length, current_line->value_len);
     print_debug("previous (incomplete) header value = %s\n", current_line->value);
   }
 
-  current_length = current_line->value_len;
-  current_line->value_len += length;
-  current_line->value = realloc(current_line->value, current_line->value_len+1);
-  memcpy(current_line->value + current_length, at, length);
-  current_line->value[current_line->value_len] = '\0';
+  current_line->value = take_token(processer, exchange, current_line->value, &(current_line->value_len), at, length);
+  if (NULL == current_line->value)
+  {
+    print_err("failed to allocate memory for the header value: %s\n", strerror(errno));
+    return 1;
+  }
 
-  processer->request.last_was_value = true;
+  exchange->request.last_was_value = true;
   return 0;
 }
 
 static int on_headers_complete(http_parser* parser) {
+  evweb_http_processer* processer = (evweb_http_processer*)parser;
+  evweb_request* request = &(processer->last_exchange->request);
+
   print_debug("headers complete\n");
-  return interpret_header((evweb_http_processer*)parser);
+  // wait until now to parse the url so we never look at half of one split across reads
+  if ( (NULL == request->url) ||
+       (0 != http_parser_parse_url(request->url, request->url_length, 0, &(request->parsed_url_info))) )
+  {
+    print_err("failed to parse the request url\n");
+    return 1;
+  }
+  return interpret_header(processer);
 }
 
 static int on_body(http_parser* parser, const char* at, size_t length) {
-  size_t current_length;
-  evweb_request* request = &(((evweb_http_processer*)parser)->request);
+  evweb_http_processer* processer = (evweb_http_processer*)parser;
+  evweb_request* request = &(processer->last_exchange->request);
 
   print_debug("body (fragment?) received (%zu bytes)\n", length);
 
-  current_length = request->body_length;
-  request->body_length += length;
-  request->body = realloc(request->body, request->body_length + 1);
+  // body fragments arrive back to back, so this normally grows the same arena allocation in place
+  request->body = append_to_arena_string(&(processer->last_exchange->arena), request->body, &(request->body_length), at, length);
   if (NULL == request->body)
   {
-    print_err("failed to realloc memory for the body: %s\n", strerror(errno));
+    print_err("failed to allocate memory for the body: %s\n", strerror(errno));
     return 1;
   }
-  memcpy(request->body + current_length, at, length);
-  ((char*)request->body)[request->body_length] = '\0';
 
   return 0;
 }
@@ -0,0 +1,16 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#include "evweb.h"
+
+#define EVWEB_ARENA_BLOCK_SIZE   4096
+#define EVWEB_ARENA_MAX_RETAINED 65536
+
+void* arena_alloc(evweb_arena* arena, size_t size);
+void* arena_extend(evweb_arena* arena, void* ptr, size_t old_size, size_t new_size);
+void arena_reset(evweb_arena* arena);
+void arena_destroy(evweb_arena* arena);
+
+#endif
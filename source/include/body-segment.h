@@ -0,0 +1,20 @@
+#ifndef _BODY_SEGMENT_H_
+#define _BODY_SEGMENT_H_
+
+#include <stddef.h>
+
+#include "evweb.h"
+
+#define EVWEB_BODY_SEGMENT_SIZE    16384
+#define EVWEB_MAX_POOLED_SEGMENTS  1024
+
+evweb_body_segment* acquire_segment(evweb_worker* worker, size_t capacity);
+evweb_body_segment* lend_segment(void* ref, size_t length, evweb_release_cb* release, void* release_ctx);
+char* segment_bytes(evweb_body_segment* segment);
+void release_segment(evweb_worker* worker, evweb_body_segment* segment);
+void release_segment_chain(evweb_worker* worker, evweb_body_segment* segment);
+void destroy_segment_pool(evweb_worker* worker);
+
+void* reserve_body_space(evweb_worker* worker, evweb_response* response, size_t length);
+
+#endif
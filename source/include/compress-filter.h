@@ -0,0 +1,18 @@
+#ifndef _COMPRESS_FILTER_H_
+#define _COMPRESS_FILTER_H_
+
+#include "evweb.h"
+
+#define EVWEB_DEFAULT_COMPRESS_MIN_LENGTH 1024
+#define EVWEB_DEFAULT_COMPRESS_MAX_LENGTH (1024 * 1024)
+// how often each worker checks how far behind its loop is running
+#define EVWEB_LAG_CHECK_INTERVAL 0.1
+
+void start_compress_filter(evweb_worker* worker);
+void stop_compress_filter(evweb_worker* worker);
+void destroy_compress_filter(evweb_worker* worker);
+
+int compress_response(evweb_exchange* exchange, evweb_response* response);
+bool accepts_encoding(char* accept_encoding, char* coding);
+
+#endif
@@ -8,15 +8,29 @@ typedef struct {
   int cb_count;
   int max_cb_count;
   void* cbs;
+  // routers are compiled into a trie, and the chain only walks the other callbacks
+  void* router;
+  // regex routers, matched together by one DFA built when the server starts
+  void* regex_routes;
+  int* chain;
+  int chain_length;
 } evweb_connect_iface;
 
 typedef void (evweb_connect_cb)(evweb_request* request, evweb_response* response, bool* next);
 
 void evweb_init_connect_iface(evweb_connect_iface* iface);
 int evweb_connect_add_function(evweb_connect_iface* iface, evweb_connect_cb cb);
+// resource is matched exactly, except that a ":name" segment captures whatever one segment is
+// there and a final "*name" segment captures the rest of the path, e.g. /users/:id/orders/*rest
 int evweb_connect_add_router(evweb_connect_iface* iface, enum http_method, char* resource, evweb_connect_cb cb);
+char* evweb_connect_route_param(evweb_request* request, char* name, size_t* length);
+// route on a regular expression the whole path has to match, like /v[12]/items/\d{1,6}. Every
+// pattern is compiled into one DFA when the server starts, so they can't capture
+int evweb_connect_add_regex_router(evweb_connect_iface* iface, enum http_method, char* pattern, evweb_connect_cb cb);
 int evweb_connect_add_static(evweb_connect_iface* iface, char* directory);
-void evweb_start_connect_server(EV_P, int port, evweb_server_settings* settings, evweb_connect_iface* iface);
+int evweb_connect_add_static_cached(evweb_connect_iface* iface, char* directory, size_t cache_size);
+int evweb_connect_add_static_mapped(evweb_connect_iface* iface, char* directory);
+evweb_server* evweb_start_connect_server(EV_P, int port, evweb_server_settings* settings, evweb_connect_iface* iface);
 void evweb_destroy_connect_iface(evweb_connect_iface* iface);
 
 #endif
@@ -1,6 +1,9 @@
 #ifndef _SERVER_CENTER_H_
 #define _SERVER_CENTER_H_
 
+#include <pthread.h>
+#include <sys/uio.h>
+
 #include <ev.h>
 #include <evn.h>
 #include <bool.h>
@@ -11,7 +14,25 @@ typedef struct evweb_header_line evweb_header_line;
 typedef struct evweb_http_processer evweb_http_processer;
 typedef struct evweb_request evweb_request;
 typedef struct evweb_response evweb_response;
+typedef struct evweb_exchange evweb_exchange;
+typedef struct evweb_output_part evweb_output_part;
+typedef struct evweb_body_segment evweb_body_segment;
+typedef struct evweb_held_buffer evweb_held_buffer;
 typedef struct evweb_server_settings evweb_server_settings;
+typedef struct evweb_server evweb_server;
+typedef struct evweb_worker evweb_worker;
+typedef struct evweb_acceptor evweb_acceptor;
+typedef struct evweb_arena evweb_arena;
+typedef struct evweb_arena_block evweb_arena_block;
+typedef struct evweb_uring evweb_uring;
+typedef struct evweb_read_buffer evweb_read_buffer;
+typedef struct evweb_read_slab evweb_read_slab;
+typedef struct evweb_route_param evweb_route_param;
+
+#define EVWEB_HANDOFF_QUEUE_SIZE 1024
+#define EVWEB_NUM_CODINGS 2
+#define EVWEB_NUM_READ_SIZES 3
+#define EVWEB_MAX_ROUTE_PARAMS 8
 
 struct evweb_header_line {
   char*  field;
@@ -20,7 +41,24 @@ struct evweb_header_line {
   size_t value_len;
 };
 
+// bump allocator backing everything parsed out of a request, rewound between messages
+struct evweb_arena {
+  evweb_arena_block* blocks;
+  size_t capacity;
+  void* last;
+};
+
+// a piece of the path a parameterized route captured, as a span of the request's url. name
+// belongs to the route
+struct evweb_route_param {
+  char* name;
+  size_t offset;
+  size_t length;
+};
+
 struct evweb_request {
+  evweb_server* server;
+
   char*  url;
   size_t url_length;
   struct http_parser_url parsed_url_info;
@@ -31,10 +69,28 @@ struct evweb_request {
   bool last_was_value;
   enum http_method method;
 
+  evweb_route_param params[EVWEB_MAX_ROUTE_PARAMS];
+  int num_params;
+
   void* body;
   size_t body_length;
 };
 
+// called once evweb is done with a body it was lent by set_response_body_ref or add_response_body_ref
+typedef void (evweb_release_cb)(void* ctx, void* data);
+
+// one piece of a response body. data holds capacity bytes of which length are used, unless the
+// piece was lent to us, in which case its bytes are at ref and it's full
+struct evweb_body_segment {
+  evweb_body_segment* next;
+  size_t length;
+  size_t capacity;
+  char* ref;
+  evweb_release_cb* release;
+  void* release_ctx;
+  char data[];
+};
+
 struct evweb_response {
   int status;
   char* status_message;
@@ -43,32 +99,241 @@ struct evweb_response {
   int num_header_lines;
   int max_num_header_lines;
 
-  void* content;
+  evweb_body_segment* body;
+  evweb_body_segment* body_last;
+  // a body we were lent rather than copied, it takes the place of the segments
+  void* body_ref;
+  evweb_release_cb* body_release;
+  void* body_release_ctx;
+  // or a file that's sent straight from its descriptor, -1 when there isn't one
+  int body_fd;
+  off_t body_fd_offset;
   char* content_type;
   size_t content_length;
 
   struct evn_stream* connection;
+  evweb_exchange* exchange;
 };
 
-struct evweb_http_processer {
-  http_parser parser;
+// a piece of a response waiting to be written. data is NULL for bytes at offset in the
+// exchange's output buffer, or for length bytes of the file fd starting at file_offset. Once
+// the piece has been written segment goes back to the pool, release is called to hand back
+// borrowed memory and fd is closed.
+struct evweb_output_part {
+  char* data;
+  size_t offset;
+  size_t length;
+  int fd;
+  off_t file_offset;
+  evweb_body_segment* segment;
+  evweb_release_cb* release;
+  void* release_ctx;
+};
+
+// one request and the response to it. A client that pipelines can have several of these in
+// flight on a connection, and their responses go out in the order the requests arrived no
+// matter which handler finishes first.
+struct evweb_exchange {
   evweb_request request;
   evweb_response response;
+  evweb_arena arena;
+
+  unsigned int seq;
+  unsigned short http_major;
+  unsigned short http_minor;
+  bool keep_alive;
+  // the whole request has been read and handed to the request handler
+  bool complete;
+  bool ended;
+  // the head has gone out and the body follows as it's produced, in chunks when chunked is set
+  bool streaming;
+  bool chunked;
+  // the answer can't have a body (HEAD, 1xx, 204, 304), so whatever is streamed to it is dropped
+  bool bodiless;
+
+  // response pieces waiting for the exchanges ahead of this one. Serialized heads live in
+  // output, bodies are separate parts so they never have to be copied
+  evweb_output_part* parts;
+  int num_parts;
+  int max_parts;
+  int sent_parts;
+  char* output;
+  size_t output_length;
+  size_t output_capacity;
+
+  evweb_exchange* next;
+};
+
+// a read buffer some in flight request still has url or header views pointing into. It can
+// go once every exchange up to last_seq has finished
+struct evweb_held_buffer {
+  void* buffer;
+  unsigned int last_seq;
+  // how to give the buffer back, it's freed when release is NULL
+  evweb_release_cb* release;
+  void* release_ctx;
+};
+
+struct evweb_http_processer {
+  http_parser parser;
+
+  // exchanges in flight, oldest first. The newest is the one the parser is filling in
+  evweb_exchange* exchanges;
+  evweb_exchange* last_exchange;
+  evweb_exchange* free_exchanges;
+  unsigned int next_seq;
+  int num_requests;
+
+  // while true responses only queue up, so one parse's worth of pipelined responses is
+  // written out together once parsing finishes
+  bool defer_flush;
+  bool closing;
+
+  // scratch for gathering every ready exchange's parts into a single writev. Whatever the
+  // socket won't take stays queued in the parts, and while write_pending is set everything
+  // waits for write_watcher to say the socket can take more
+  struct iovec* iov;
+  int max_iov;
+  bool write_pending;
+  bool close_on_drain;
+  ev_io write_watcher;
+  // we read the socket ourselves into the worker's pooled buffers, using the size that's been
+  // fitting this connection's requests
+  ev_io read_watcher;
+  int read_size;
+  size_t read_average;
+
+  // the read buffer being parsed right now, and the earlier ones still being pointed into
+  char* input_start;
+  char* input_end;
+  bool input_held;
+  // the read buffer has to go back as soon as it's been parsed, because it's a slot in the
+  // io_uring buffer ring every connection on the worker shares. Tokens are copied out of it
+  // rather than pointed into, or a few hundred half-sent requests could pin every slot
+  bool copy_tokens;
+  // with io_uring we do the reading ourselves. A receive can still complete after the stream
+  // has closed, so the processer is only released once the kernel is done with it
+  bool recv_armed;
+  bool recv_starved;
+  bool stream_closed;
+  evweb_http_processer* next_starved;
+  evweb_held_buffer* held_buffers;
+  int num_held_buffers;
+  int max_held_buffers;
+
+  evweb_worker* worker;
+  evweb_http_processer* next_free;
 };
 
 struct evweb_server_settings {
   int max_keep_alive;
+  // requests served on one connection before we close it, 0 for no limit
+  int max_requests;
+  // number of event loops accepting connections. Each has its own SO_REUSEPORT listener, the
+  // first runs on the loop passed to evweb_start_server and the rest on threads we start.
+  int workers;
+  // accept every connection on one dedicated thread and hand the sockets to the least busy
+  // worker, instead of letting the kernel pick a worker with SO_REUSEPORT
+  bool acceptor_thread;
+  // how many processers of closed connections each worker keeps around for reuse.
+  // 0 picks a default and a negative value turns the pool off
+  int max_pooled_processers;
+  // responses with bodies at least this long and a textual type are compressed when the client
+  // accepts it. 0 picks a default and a negative value turns compression off
+  int compress_min_length;
+  // bodies longer than this are sent as they are rather than compressed on the loop. 0 picks
+  // a default and a negative value lifts the limit
+  long compress_max_length;
+  // accept and read with io_uring (multishot accept, multishot receive into a ring of provided
+  // buffers) instead of waiting on readiness events. Falls back to libev when the kernel can't
+  bool io_uring;
+  // back the pooled read buffers with huge pages when the system has them to give
+  bool huge_read_buffers;
 };
 
 typedef void (evweb_on_connection)(evweb_request* request, evweb_response* reponse);
 
+// a worker is one event loop and the listener feeding it. Everything hanging off a connection
+// is only ever touched from the loop of the worker that accepted it.
+struct evweb_worker {
+  evweb_server* server;
+  EV_P;
+  int index;
+
+  int listen_fd;
+  ev_io accept_watcher;
+  ev_async stop_watcher;
+
+  // sockets accepted by the acceptor thread waiting for this worker to pick them up
+  ev_async handoff_watcher;
+  int handoff_fds[EVWEB_HANDOFF_QUEUE_SIZE];
+  unsigned int handoff_head;
+  unsigned int handoff_tail;
+
+  bool threaded;
+  pthread_t thread;
+  int num_connections;
+
+  evweb_http_processer* free_processers;
+  int num_free_processers;
+  evweb_body_segment* free_segments;
+  int num_free_segments;
+
+  // the Date header every response on this loop gets, rendered again when the second changes
+  char date_header[48];
+  size_t date_header_length;
+  ev_tstamp date_header_time;
+
+  // deflate streams reused by every compressed response on this loop, one per coding. The
+  // level drops as the loop falls behind, so compression gives way when the CPU is saturated
+  struct z_stream_s* compressors[EVWEB_NUM_CODINGS];
+  int compressor_levels[EVWEB_NUM_CODINGS];
+  int compress_level;
+  ev_timer lag_timer;
+  ev_tstamp lag_check_time;
+  ev_tstamp loop_lag;
+
+  // read buffers ready for reuse, one list per size. They're carved out of slabs that are only
+  // unmapped along with the server
+  evweb_read_buffer* free_read_buffers[EVWEB_NUM_READ_SIZES];
+  evweb_read_slab* read_slabs;
+
+  // NULL unless the server was asked for io_uring and the kernel could do it
+  evweb_uring* uring;
+};
+
+struct evweb_acceptor {
+  EV_P;
+  int listen_fd;
+  ev_io accept_watcher;
+  ev_async stop_watcher;
+
+  bool threaded;
+  pthread_t thread;
+  int next_worker;
+};
+
+struct evweb_server {
+  evweb_on_connection* request_handler;
+  evweb_server_settings* settings;
+  void* data;
+
+  int port;
+  bool closed;
+  int num_workers;
+  evweb_worker* workers;
+  evweb_acceptor acceptor;
+};
+
 // private
 int interpret_header(evweb_http_processer* parser);
 int finish_message(evweb_http_processer* parser);
 
 // public
-void evweb_start_server(EV_P, int port, evweb_server_settings* settings, evweb_on_connection callback);
-void evweb_close_server();
+evweb_server* evweb_start_server(EV_P, int port, evweb_server_settings* settings, evweb_on_connection callback, void* data);
+void evweb_close_server(evweb_server* server);
+
+char* get_request_header(evweb_request* request, char* field);
 
 int set_response_status(evweb_response* response, int status, char* message);
 int add_response_header(evweb_response* response, char* field, char* value);
@@ -77,10 +342,36 @@ int clear_response_headers(evweb_response* response);
 int set_response_body(evweb_response* response, void* body, size_t body_length, char* type);
 int add_to_response_body(evweb_response* response, void* body, size_t body_length, char* type);
 int clear_response_body(evweb_response* response);
+// use body as the response body without copying it. However slowly the client reads, it's
+// written straight from body, so it must stay valid until release is called. That happens once
+// its last byte has been written, or the response or connection is dropped. It's never
+// compressed, so lend an already compressed body if the client should get one. release can be NULL
+int set_response_body_ref(evweb_response* response, void* body, size_t body_length, char* type, evweb_release_cb* release, void* ctx);
+// lend body to the end of the response body, on the same terms as set_response_body_ref
+int add_response_body_ref(evweb_response* response, void* body, size_t body_length, evweb_release_cb* release, void* ctx);
+// send body_length bytes of the file fd from offset as the body with sendfile. evweb owns fd
+// from here on and closes it once it's been sent or the response is cleared
+int set_response_body_file(evweb_response* response, int fd, off_t offset, size_t body_length, char* type);
+// advertise a body_length byte body without having one, for answering HEAD
+int set_response_length(evweb_response* response, size_t body_length, char* type);
+
+// build the body in place: reserve hands out room for at least length bytes at the end of the
+// body and commit adds the first length of them once they've been written
+void* reserve_response_body(evweb_response* response, size_t length);
+int commit_response_body(evweb_response* response, size_t length);
+int printf_response_body(evweb_response* response, const char* format, ...) __attribute__ ((format (printf, 2, 3)));
 
 bool send_response(evweb_response* response);
 int end_response(evweb_response* response);
 
+// stream a body of unknown length: begin sends the head straight away and every chunk goes out
+// as it's written. They return 0 once everything is written, 1 if some is still waiting on the
+// socket and -1 if the connection is gone. Chunks written to an answer that can't have a body
+// (HEAD, 1xx, 204 or 304) are dropped.
+int evweb_response_begin_chunked(evweb_response* response);
+int evweb_response_write_chunk(evweb_response* response, void* data, size_t length);
+int evweb_response_end_chunked(evweb_response* response);
+
 char* query_to_json(char* query_in, char* json_buffer, size_t json_size);
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef _PROCESSER_POOL_H_
+#define _PROCESSER_POOL_H_
+
+#include "evweb.h"
+
+#define EVWEB_DEFAULT_POOLED_PROCESSERS 256
+
+evweb_http_processer* acquire_processer(evweb_worker* worker);
+void release_processer(evweb_worker* worker, evweb_http_processer* processer);
+void destroy_processer_pool(evweb_worker* worker);
+
+evweb_exchange* acquire_exchange(evweb_http_processer* processer);
+void retire_exchange(evweb_http_processer* processer);
+void drop_last_exchange(evweb_http_processer* processer);
+
+int hold_input_buffer(evweb_http_processer* processer, void* buffer, evweb_release_cb* release, void* release_ctx);
+void release_input_buffers(evweb_http_processer* processer);
+
+#endif
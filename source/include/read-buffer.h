@@ -0,0 +1,34 @@
+#ifndef _READ_BUFFER_H_
+#define _READ_BUFFER_H_
+
+#include <stddef.h>
+
+#include "evweb.h"
+
+// every read size is four times the one before, starting from this
+#define EVWEB_READ_BUFFER_MIN_SIZE 4096
+#define EVWEB_READ_SLAB_SIZE       (256 * 1024)
+#define EVWEB_READ_HUGE_SLAB_SIZE  (2 * 1024 * 1024)
+
+struct evweb_read_buffer {
+  evweb_read_buffer* next;
+  int size;
+  // false for the odd one malloc'd when no slab could be mapped
+  bool pooled;
+  char data[] __attribute__ ((aligned (16)));
+};
+
+struct evweb_read_slab {
+  void* memory;
+  size_t length;
+  evweb_read_slab* next;
+};
+
+char* acquire_read_buffer(evweb_worker* worker, int size, size_t* capacity);
+// evweb_release_cb for read buffers, ctx is the worker
+void release_read_buffer(void* ctx, void* data);
+void destroy_read_buffer_pool(evweb_worker* worker);
+
+void update_read_size(evweb_http_processer* processer, size_t length, size_t capacity);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _REGEX_SET_H_
+#define _REGEX_SET_H_
+
+#include <stddef.h>
+
+#include <bool.h>
+
+// a set of patterns whose DFA needs more states than this won't compile
+#define EVWEB_REGEX_MAX_STATES  65536
+// the most a counted repeat like {2,5} can ask for
+#define EVWEB_REGEX_MAX_REPEAT  255
+#define EVWEB_REGEX_MAX_DEPTH   64
+
+typedef struct evweb_nfa_state evweb_nfa_state;
+typedef struct evweb_regex_set evweb_regex_set;
+
+enum evweb_nfa_type {
+  EVWEB_NFA_SET,
+  EVWEB_NFA_SPLIT,
+  EVWEB_NFA_ACCEPT,
+};
+
+// SET moves to out on any byte in bytes. SPLIT moves to out and out1 without reading anything,
+// out1 is -1 when there's only the one way on
+struct evweb_nfa_state {
+  enum evweb_nfa_type type;
+  int out;
+  int out1;
+  int pattern;
+  unsigned char bytes[32];
+};
+
+struct evweb_regex_set {
+  // every pattern's NFA, built as they're added
+  evweb_nfa_state* nfa;
+  int nfa_length;
+  int nfa_capacity;
+  int* starts;
+  int* positions;
+  int num_patterns;
+  int max_patterns;
+
+  // the DFA for all of them together. Bytes no pattern tells apart share a class, and a state
+  // has one transition per class. State 0 matches nothing and 1 is where matching starts
+  unsigned char byte_class[256];
+  int num_classes;
+  int* transitions;
+  int num_states;
+  // the positions of the patterns a state matches are accepts[accept_offsets[state]] up to
+  // accepts[accept_offsets[state + 1]]
+  int* accept_offsets;
+  int* accepts;
+};
+
+evweb_regex_set* regex_set_create(void);
+void regex_set_destroy(evweb_regex_set* set);
+
+// add a pattern for the callback at position. The whole path has to match it
+int regex_set_add(evweb_regex_set* set, char* pattern, int position);
+int regex_set_compile(evweb_regex_set* set);
+// the positions of every pattern that matches path, in the order they were added. Returns NULL
+// when nothing does
+int* regex_set_match(evweb_regex_set* set, char* path, size_t path_length, int* count);
+
+#endif
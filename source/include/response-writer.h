@@ -0,0 +1,18 @@
+#ifndef _RESPONSE_WRITER_H_
+#define _RESPONSE_WRITER_H_
+
+#include <time.h>
+
+#include "evweb.h"
+
+int queue_response(evweb_exchange* exchange, evweb_response* response);
+int queue_output(evweb_exchange* exchange, void* data, size_t length);
+int queue_chunk(evweb_exchange* exchange, void* data, size_t length);
+int queue_file(evweb_exchange* exchange, int fd, off_t offset, size_t length);
+bool flush_exchanges(evweb_http_processer* processer);
+void clear_output_parts(evweb_worker* worker, evweb_exchange* exchange);
+
+size_t format_http_date(char* out, size_t size, time_t time);
+bool parse_http_date(char* date, time_t* time);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include <stddef.h>
+
+#include <bool.h>
+
+#include "evweb.h"
+
+#define EVWEB_NUM_METHODS (HTTP_PATCH + 1)
+
+typedef struct evweb_route_node evweb_route_node;
+typedef struct evweb_route_targets evweb_route_targets;
+typedef struct evweb_router evweb_router;
+
+// the callbacks routed for one method on one path, by their position in the connect chain
+struct evweb_route_targets {
+  int* positions;
+  int count;
+  int max_count;
+};
+
+// one segment of a path, the part between two slashes. Children are kept sorted so the
+// segment after this one is found with a binary search. A ":name" segment lives in param and
+// matches any one segment, a "*name" segment lives in wildcard and matches the rest of the path.
+// Either way segment holds just the name
+struct evweb_route_node {
+  char* segment;
+  size_t segment_length;
+  evweb_route_node** children;
+  int num_children;
+  int max_children;
+  evweb_route_node* param;
+  evweb_route_node* wildcard;
+  evweb_route_targets methods[EVWEB_NUM_METHODS];
+};
+
+struct evweb_router {
+  evweb_route_node root;
+  int num_routes;
+};
+
+evweb_router* router_create(void);
+void router_destroy(evweb_router* router);
+
+int router_add(evweb_router* router, enum http_method method, char* resource, int position);
+// the positions of the callbacks routed for method on path, in the order they were added, with
+// whatever the route captured in params as offsets into path. Returns NULL when there aren't any
+int* router_lookup(evweb_router* router, enum http_method method, char* path, size_t path_length,
+                   evweb_route_param* params, int* num_params, int* count);
+
+#endif
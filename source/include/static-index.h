@@ -0,0 +1,105 @@
+#ifndef _STATIC_INDEX_H_
+#define _STATIC_INDEX_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ev.h>
+
+#include "evweb.h"
+
+// files bigger than this are never cached, they're sent straight from disk
+#define EVWEB_STATIC_CACHE_MAX_FILE (256 * 1024)
+// the sizes worth mapping. Smaller files cost more to map than to send, and bigger ones would
+// tie up too much address space
+#define EVWEB_STATIC_MAP_MIN_FILE   (16 * 1024)
+#define EVWEB_STATIC_MAP_MAX_FILE   (64 * 1024 * 1024)
+
+typedef struct evweb_static_entry evweb_static_entry;
+typedef struct evweb_static_table evweb_static_table;
+typedef struct evweb_static_watch evweb_static_watch;
+typedef struct evweb_static_index evweb_static_index;
+
+typedef char* (evweb_static_type_cb)(char* extension);
+
+// A file under the root, as of the last time we heard about it. Every table it's in and every
+// response still sending its body holds a reference.
+struct evweb_static_entry {
+  char* path;
+  size_t path_length;
+  unsigned int hash;
+
+  size_t size;
+  time_t mtime;
+  char* type;
+  // validators for conditional requests, worked out once when the file is indexed
+  char etag[80];
+  char last_modified[32];
+
+  // the file's contents when it's cached, NULL otherwise
+  char* body;
+  // or the file mapped into memory, unmapped once the last reference goes
+  char* map;
+
+  int refs;
+  unsigned long last_used;
+};
+
+// Lookups go through an immutable snapshot of the index. Changes build a new table and swap it
+// in, and the old one is only freed once no reader can still be looking at it.
+struct evweb_static_table {
+  evweb_static_entry** buckets;
+  size_t num_buckets;
+  int num_entries;
+  size_t cached_bytes;
+
+  unsigned long retired_epoch;
+  evweb_static_table* next_retired;
+};
+
+// a directory inotify is watching for us, relative to the root
+struct evweb_static_watch {
+  int wd;
+  char* path;
+};
+
+struct evweb_static_index {
+  char* directory;
+  size_t cache_size;
+  bool map_files;
+  evweb_static_type_cb* guess_type;
+
+  evweb_static_table* table;
+  pthread_mutex_t lock;
+
+  // every reader (one per worker) publishes the epoch it started reading in, 0 when it isn't
+  unsigned long epoch;
+  unsigned long* reader_epochs;
+  int num_readers;
+  evweb_static_table* retired;
+
+  // bumped by every change, so a cache fill that raced with one knows not to keep what it read
+  unsigned long generation;
+
+  EV_P;
+  int inotify_fd;
+  ev_io inotify_watcher;
+  ev_timer reclaim_timer;
+  evweb_static_watch* watches;
+  int num_watches;
+  int max_watches;
+};
+
+evweb_static_index* static_index_create(char* directory, size_t cache_size, bool map_files, evweb_static_type_cb* guess_type);
+int static_index_start(EV_P, evweb_static_index* index, int num_readers);
+void static_index_destroy(evweb_static_index* index);
+
+evweb_static_entry* static_index_lookup(evweb_static_index* index, int reader, unsigned long now, char* path, size_t path_length);
+evweb_static_entry* static_index_cache(evweb_static_index* index, evweb_static_entry* entry, unsigned long now);
+evweb_static_entry* static_index_map(evweb_static_index* index, evweb_static_entry* entry);
+void static_index_full_path(evweb_static_index* index, evweb_static_entry* entry, char* full_path, size_t size);
+void static_index_retain(evweb_static_entry* entry);
+void static_index_release(void* ctx, void* data);
+
+#endif
@@ -3,8 +3,14 @@
 
 #include "evweb.h"
 
-void start_tcp_server(EV_P, int port, evweb_server_settings* settings);
-void close_tcp_server();
+int start_tcp_server(EV_P, evweb_server* server);
+void close_tcp_server(evweb_server* server);
+void release_tcp_server(evweb_server* server);
+
+void accept_stream(EV_P, evweb_worker* worker, int fd);
+void receive_input(EV_P, struct evn_stream* stream, void* data, int size, evweb_release_cb* release, void* release_ctx);
+void end_input(EV_P, struct evn_stream* stream);
+void finish_connection(evweb_http_processer* processer);
 
 #endif
 
@@ -0,0 +1,64 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+
+#include <ev.h>
+
+#include "evweb.h"
+
+#define EVWEB_URING_ENTRIES      256
+// receive buffers the kernel picks from, shared by every connection on the worker. The count
+// has to be a power of 2
+#define EVWEB_URING_BUFFERS      512
+#define EVWEB_URING_BUFFER_SIZE  8192
+#define EVWEB_URING_BUFFER_GROUP 0
+
+struct evweb_uring {
+  evweb_worker* worker;
+  int ring_fd;
+
+  // submission queue, shared with the kernel
+  void* sq_ring;
+  size_t sq_ring_size;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+
+  // completion queue, shared with the kernel (and often the same mapping as the submissions)
+  void* cq_ring;
+  size_t cq_ring_size;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // the kernel signals completions on this, so they're handled from the worker's loop
+  int event_fd;
+  ev_io event_watcher;
+
+  int listen_fd;
+  bool accepting;
+
+  struct io_uring_buf_ring* buf_ring;
+  size_t buf_ring_size;
+  char* buffers;
+  unsigned short buf_tail;
+  // connections whose receive ended because every buffer was in use
+  evweb_http_processer* starved;
+};
+
+evweb_uring* uring_create(evweb_worker* worker);
+void uring_destroy(evweb_uring* uring);
+
+int uring_accept(evweb_uring* uring, int listen_fd);
+void uring_stop_accept(evweb_uring* uring);
+int uring_receive(evweb_uring* uring, evweb_http_processer* processer);
+bool uring_forget(evweb_uring* uring, evweb_http_processer* processer);
+
+#endif
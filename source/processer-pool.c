@@ -0,0 +1,379 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "evweb.h"
+#include "arena.h"
+#include "body-segment.h"
+#include "processer-pool.h"
+#include "response-writer.h"
+
+#ifndef DEBUG_PROCESSER_POOL
+  #ifdef DEBUG
+    #define DEBUG_PROCESSER_POOL 1
+  #else
+    #define DEBUG_PROCESSER_POOL 0
+  #endif
+#endif
+
+#if DEBUG_PROCESSER_POOL
+  #define print_debug(...) printf("[processer-pool] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[processer-pool] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[processer-pool] " __VA_ARGS__)
+
+static int  pool_high_water(evweb_worker* worker);
+static void clear_header_lines(evweb_header_line* header_lines, int num_header_lines);
+static void clear_exchange(evweb_worker* worker, evweb_exchange* exchange);
+static void free_exchange(evweb_exchange* exchange);
+static void clear_processer(evweb_http_processer* processer);
+static void free_processer(evweb_http_processer* processer);
+
+// Every worker keeps the processers of closed connections on a free list instead of handing
+// them back to malloc. A pooled processer keeps its exchanges (with their arenas and header
+// arrays) and its buffers, so picking one up for a new connection costs no allocation at all.
+evweb_http_processer* acquire_processer(evweb_worker* worker) {
+  evweb_http_processer* processer;
+  evweb_exchange* free_exchanges;
+  evweb_held_buffer* held_buffers;
+  int max_held_buffers;
+  struct iovec* iov;
+  int max_iov;
+
+  processer = worker->free_processers;
+  if (NULL == processer)
+  {
+    print_debug("worker %d pool is empty, allocating a new processer\n", worker->index);
+    // we want to use calloc so all of the pointer start as NULL, and all the counters start at 0
+    processer = calloc(1, sizeof (evweb_http_processer));
+    if (NULL == processer)
+    {
+      print_err("failed to allocate memory for a processer: %s\n", strerror(errno));
+      return NULL;
+    }
+    processer->worker = worker;
+    return processer;
+  }
+  worker->free_processers = processer->next_free;
+  worker->num_free_processers -= 1;
+
+  // reset in place, keeping only the capacity we already paid for
+  free_exchanges = processer->free_exchanges;
+  held_buffers = processer->held_buffers;
+  max_held_buffers = processer->max_held_buffers;
+  iov = processer->iov;
+  max_iov = processer->max_iov;
+
+  memset(processer, 0, sizeof (evweb_http_processer));
+
+  processer->free_exchanges = free_exchanges;
+  processer->held_buffers = held_buffers;
+  processer->max_held_buffers = max_held_buffers;
+  processer->iov = iov;
+  processer->max_iov = max_iov;
+  processer->worker = worker;
+
+  return processer;
+}
+
+void release_processer(evweb_worker* worker, evweb_http_processer* processer) {
+  clear_processer(processer);
+
+  if (worker->num_free_processers >= pool_high_water(worker))
+  {
+    print_debug("worker %d pool is at its high-water mark, freeing processer\n", worker->index);
+    free_processer(processer);
+    return;
+  }
+
+  processer->next_free = worker->free_processers;
+  worker->free_processers = processer;
+  worker->num_free_processers += 1;
+}
+
+// start a new exchange at the back of the connection's queue
+evweb_exchange* acquire_exchange(evweb_http_processer* processer) {
+  evweb_exchange* exchange;
+
+  exchange = processer->free_exchanges;
+  if (NULL == exchange)
+  {
+    exchange = calloc(1, sizeof (evweb_exchange));
+    if (NULL == exchange)
+    {
+      print_err("failed to allocate memory for an exchange: %s\n", strerror(errno));
+      return NULL;
+    }
+  }
+  else
+  {
+    processer->free_exchanges = exchange->next;
+  }
+
+  exchange->seq = processer->next_seq;
+  processer->next_seq += 1;
+  exchange->keep_alive = false;
+  exchange->complete = false;
+  exchange->ended = false;
+  exchange->streaming = false;
+  exchange->chunked = false;
+  exchange->bodiless = false;
+  exchange->next = NULL;
+
+  exchange->request.server = processer->worker->server;
+  exchange->request.method = 0;
+  exchange->request.last_was_value = true;
+  memset(&(exchange->request.parsed_url_info), 0, sizeof (struct http_parser_url));
+
+  exchange->response.status = -1;
+  exchange->response.body_fd = -1;
+  exchange->response.connection = (struct evn_stream*)processer->parser.data;
+  exchange->response.exchange = exchange;
+  if (NULL == exchange->response.header_lines)
+  {
+    exchange->response.max_num_header_lines = 5;
+    exchange->response.header_lines = calloc(exchange->response.max_num_header_lines, sizeof(evweb_header_line));
+  }
+
+  if (NULL == processer->last_exchange)
+  {
+    processer->exchanges = exchange;
+  }
+  else
+  {
+    processer->last_exchange->next = exchange;
+  }
+  processer->last_exchange = exchange;
+
+  return exchange;
+}
+
+// the oldest exchange is done, recycle it and any read buffers only it was using
+void retire_exchange(evweb_http_processer* processer) {
+  evweb_exchange* exchange = processer->exchanges;
+
+  processer->exchanges = exchange->next;
+  if (NULL == processer->exchanges)
+  {
+    processer->last_exchange = NULL;
+  }
+
+  clear_exchange(processer->worker, exchange);
+  exchange->next = processer->free_exchanges;
+  processer->free_exchanges = exchange;
+
+  release_input_buffers(processer);
+}
+
+// the newest exchange will never be complete because the client stopped sending halfway
+// through it, recycle it without waiting for the ones ahead of it
+void drop_last_exchange(evweb_http_processer* processer) {
+  evweb_exchange* exchange = processer->last_exchange;
+  evweb_exchange* previous = NULL;
+  evweb_exchange* current;
+
+  for (current = processer->exchanges; current != exchange; current = current->next)
+  {
+    previous = current;
+  }
+
+  if (NULL == previous)
+  {
+    processer->exchanges = NULL;
+  }
+  else
+  {
+    previous->next = NULL;
+  }
+  processer->last_exchange = previous;
+
+  clear_exchange(processer->worker, exchange);
+  exchange->next = processer->free_exchanges;
+  processer->free_exchanges = exchange;
+
+  release_input_buffers(processer);
+}
+
+// keep a read buffer alive because an exchange in flight has views pointing into it
+int hold_input_buffer(evweb_http_processer* processer, void* buffer, evweb_release_cb* release, void* release_ctx) {
+  evweb_held_buffer* held_buffers;
+  int max_held_buffers;
+
+  if (processer->num_held_buffers == processer->max_held_buffers)
+  {
+    max_held_buffers = (0 == processer->max_held_buffers) ? 4 : processer->max_held_buffers * 2;
+    held_buffers = realloc(processer->held_buffers, max_held_buffers * sizeof (evweb_held_buffer));
+    if (NULL == held_buffers)
+    {
+      print_err("failed to allocate memory to hold read buffers: %s\n", strerror(errno));
+      return errno;
+    }
+    processer->held_buffers = held_buffers;
+    processer->max_held_buffers = max_held_buffers;
+  }
+
+  // the newest exchange to have started is the last one that can be pointing into this buffer
+  processer->held_buffers[processer->num_held_buffers].buffer = buffer;
+  processer->held_buffers[processer->num_held_buffers].last_seq = processer->next_seq - 1;
+  processer->held_buffers[processer->num_held_buffers].release = release;
+  processer->held_buffers[processer->num_held_buffers].release_ctx = release_ctx;
+  processer->num_held_buffers += 1;
+
+  release_input_buffers(processer);
+  return 0;
+}
+
+// give back the held buffers no exchange in flight can still be pointing into
+void release_input_buffers(evweb_http_processer* processer) {
+  int i;
+  int released;
+  unsigned int oldest_seq;
+
+  oldest_seq = (NULL == processer->exchanges) ? processer->next_seq : processer->exchanges->seq;
+
+  // buffers are held in the order they were read, so only a prefix can be done with
+  for (released = 0; released < processer->num_held_buffers; released += 1)
+  {
+    if ((int)(processer->held_buffers[released].last_seq - oldest_seq) >= 0)
+    {
+      break;
+    }
+    if (NULL != processer->held_buffers[released].release)
+    {
+      processer->held_buffers[released].release(processer->held_buffers[released].release_ctx, processer->held_buffers[released].buffer);
+    }
+    else
+    {
+      free(processer->held_buffers[released].buffer);
+    }
+  }
+
+  if (released > 0)
+  {
+    for (i = released; i < processer->num_held_buffers; i += 1)
+    {
+      processer->held_buffers[i - released] = processer->held_buffers[i];
+    }
+    processer->num_held_buffers -= released;
+  }
+}
+
+void destroy_processer_pool(evweb_worker* worker) {
+  evweb_http_processer* processer;
+
+  while (NULL != worker->free_processers)
+  {
+    processer = worker->free_processers;
+    worker->free_processers = processer->next_free;
+    free_processer(processer);
+  }
+  worker->num_free_processers = 0;
+}
+
+static int pool_high_water(evweb_worker* worker) {
+  int high_water = worker->server->settings->max_pooled_processers;
+
+  if (0 == high_water)
+  {
+    return EVWEB_DEFAULT_POOLED_PROCESSERS;
+  }
+  if (high_water < 0)
+  {
+    return 0;
+  }
+  return high_water;
+}
+
+static void clear_header_lines(evweb_header_line* header_lines, int num_header_lines) {
+  int i;
+  evweb_header_line* current_line;
+
+  current_line = header_lines;
+  for (i = 0; i < num_header_lines; i += 1)
+  {
+    free(current_line->field);
+    current_line->field = NULL;
+    free(current_line->value);
+    current_line->value = NULL;
+    current_line += 1;
+  }
+}
+
+// free everything the exchange's message left behind, but leave the arena and header array allocated
+static void clear_exchange(evweb_worker* worker, evweb_exchange* exchange) {
+  // the request information all lives in the arena or the read buffers
+  arena_reset(&(exchange->arena));
+  exchange->request.header_lines = NULL;
+  exchange->request.num_header_lines = 0;
+  exchange->request.max_num_header_lines = 0;
+  exchange->request.url = NULL;
+  exchange->request.url_length = 0;
+  exchange->request.body = NULL;
+  exchange->request.body_length = 0;
+
+  // then the response information
+  clear_header_lines(exchange->response.header_lines, exchange->response.num_header_lines);
+  exchange->response.num_header_lines = 0;
+
+  free(exchange->response.status_message);
+  exchange->response.status_message = NULL;
+
+  release_segment_chain(worker, exchange->response.body);
+  exchange->response.body = NULL;
+  exchange->response.body_last = NULL;
+  if ( (NULL != exchange->response.body_ref) && (NULL != exchange->response.body_release) )
+  {
+    exchange->response.body_release(exchange->response.body_release_ctx, exchange->response.body_ref);
+  }
+  exchange->response.body_ref = NULL;
+  exchange->response.body_release = NULL;
+  exchange->response.body_release_ctx = NULL;
+  if (-1 != exchange->response.body_fd)
+  {
+    close(exchange->response.body_fd);
+    exchange->response.body_fd = -1;
+  }
+  exchange->response.content_length = 0;
+
+  free(exchange->response.content_type);
+  exchange->response.content_type = NULL;
+
+  clear_output_parts(worker, exchange);
+}
+
+static void free_exchange(evweb_exchange* exchange) {
+  arena_destroy(&(exchange->arena));
+  free(exchange->response.header_lines);
+  free(exchange->parts);
+  free(exchange->output);
+  free(exchange);
+}
+
+static void clear_processer(evweb_http_processer* processer) {
+  while (NULL != processer->exchanges)
+  {
+    retire_exchange(processer);
+  }
+
+  // with nothing in flight every held buffer is released
+  release_input_buffers(processer);
+}
+
+static void free_processer(evweb_http_processer* processer) {
+  evweb_exchange* exchange;
+
+  while (NULL != processer->free_exchanges)
+  {
+    exchange = processer->free_exchanges;
+    processer->free_exchanges = exchange->next;
+    free_exchange(exchange);
+  }
+  free(processer->held_buffers);
+  free(processer->iov);
+  free(processer);
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "evweb.h"
+#include "read-buffer.h"
+
+#ifndef DEBUG_READ_BUFFER
+  #ifdef DEBUG
+    #define DEBUG_READ_BUFFER 1
+  #else
+    #define DEBUG_READ_BUFFER 0
+  #endif
+#endif
+
+#if DEBUG_READ_BUFFER
+  #define print_debug(...) printf("[read-buffer] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[read-buffer] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[read-buffer] " __VA_ARGS__)
+
+static size_t read_buffer_size(int size);
+static int add_slab(evweb_worker* worker, int size);
+
+// Connections read into buffers from the worker's pool instead of a fresh malloc per read. A
+// buffer goes back on its free list once the parser is done with it, which is usually right
+// after the read that filled it.
+char* acquire_read_buffer(evweb_worker* worker, int size, size_t* capacity) {
+  evweb_read_buffer* buffer;
+
+  if ( (NULL != worker->free_read_buffers[size]) || (0 == add_slab(worker, size)) )
+  {
+    buffer = worker->free_read_buffers[size];
+    worker->free_read_buffers[size] = buffer->next;
+  }
+  else
+  {
+    buffer = malloc(read_buffer_size(size));
+    if (NULL == buffer)
+    {
+      print_err("failed to allocate memory for a read buffer: %s\n", strerror(errno));
+      return NULL;
+    }
+    buffer->size = size;
+    buffer->pooled = false;
+  }
+
+  buffer->next = NULL;
+  *capacity = read_buffer_size(size) - offsetof(evweb_read_buffer, data);
+  return buffer->data;
+}
+
+void release_read_buffer(void* ctx, void* data) {
+  evweb_worker* worker = (evweb_worker*)ctx;
+  evweb_read_buffer* buffer = (evweb_read_buffer*)((char*)data - offsetof(evweb_read_buffer, data));
+
+  if (false == buffer->pooled)
+  {
+    free(buffer);
+    return;
+  }
+  buffer->next = worker->free_read_buffers[buffer->size];
+  worker->free_read_buffers[buffer->size] = buffer;
+}
+
+void destroy_read_buffer_pool(evweb_worker* worker) {
+  evweb_read_slab* slab;
+  int i;
+
+  while (NULL != worker->read_slabs)
+  {
+    slab = worker->read_slabs;
+    worker->read_slabs = slab->next;
+    munmap(slab->memory, slab->length);
+    free(slab);
+  }
+  for (i = 0; i < EVWEB_NUM_READ_SIZES; i += 1)
+  {
+    worker->free_read_buffers[i] = NULL;
+  }
+}
+
+// Move the connection to a bigger buffer as soon as a read fills one, and back down once the
+// reads have been fitting comfortably in the smaller size for a while.
+void update_read_size(evweb_http_processer* processer, size_t length, size_t capacity) {
+  if ( (length >= capacity) && (processer->read_size < EVWEB_NUM_READ_SIZES - 1) )
+  {
+    processer->read_size += 1;
+    processer->read_average = capacity;
+    return;
+  }
+
+  processer->read_average = (3 * processer->read_average + length) / 4;
+  if ( (processer->read_size > 0) && (processer->read_average < read_buffer_size(processer->read_size - 1) / 2) )
+  {
+    processer->read_size -= 1;
+  }
+}
+
+static size_t read_buffer_size(int size) {
+  return (size_t)EVWEB_READ_BUFFER_MIN_SIZE << (2 * size);
+}
+
+// Map a slab and cut it into buffers of one size. With huge_read_buffers set we ask for
+// reserved huge pages first and settle for transparent ones.
+static int add_slab(evweb_worker* worker, int size) {
+  bool huge = worker->server->settings->huge_read_buffers;
+  size_t length = (true == huge) ? EVWEB_READ_HUGE_SLAB_SIZE : EVWEB_READ_SLAB_SIZE;
+  size_t buffer_size = read_buffer_size(size);
+  evweb_read_slab* slab;
+  evweb_read_buffer* buffer;
+  void* memory = MAP_FAILED;
+  size_t offset;
+
+  slab = malloc(sizeof (evweb_read_slab));
+  if (NULL == slab)
+  {
+    print_err("failed to allocate memory for a read buffer slab: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (true == huge)
+  {
+    memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (MAP_FAILED == memory)
+    {
+      print_debug("no huge pages reserved for read buffers: %s\n", strerror(errno));
+    }
+  }
+  if (MAP_FAILED == memory)
+  {
+    memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == memory)
+    {
+      print_err("failed to map a read buffer slab: %s\n", strerror(errno));
+      free(slab);
+      return -1;
+    }
+    if (true == huge)
+    {
+      madvise(memory, length, MADV_HUGEPAGE);
+    }
+  }
+  print_debug("worker %d mapped a %zu byte slab of %zu byte read buffers\n", worker->index, length, buffer_size);
+
+  slab->memory = memory;
+  slab->length = length;
+  slab->next = worker->read_slabs;
+  worker->read_slabs = slab;
+
+  for (offset = 0; offset + buffer_size <= length; offset += buffer_size)
+  {
+    buffer = (evweb_read_buffer*)((char*)memory + offset);
+    buffer->size = size;
+    buffer->pooled = true;
+    buffer->next = worker->free_read_buffers[size];
+    worker->free_read_buffers[size] = buffer;
+  }
+  return 0;
+}
@@ -0,0 +1,931 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "regex-set.h"
+
+#ifndef DEBUG_REGEX_SET
+  #ifdef DEBUG
+    #define DEBUG_REGEX_SET 1
+  #else
+    #define DEBUG_REGEX_SET 0
+  #endif
+#endif
+
+#if DEBUG_REGEX_SET
+  #define print_debug(...) printf("[regex-set] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[regex-set] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[regex-set] " __VA_ARGS__)
+
+#define has_byte(bytes, c) (0 != ((bytes)[(c) >> 3] & (1 << ((c) & 7))))
+#define add_byte(bytes, c) ((bytes)[(c) >> 3] |= (1 << ((c) & 7)))
+
+// a piece of NFA with one way in and one way out. end's out is still -1, waiting to be
+// pointed at whatever comes next
+typedef struct {
+  int start;
+  int end;
+} nfa_fragment;
+
+typedef struct {
+  evweb_regex_set* set;
+  char* pattern;
+  char* at;
+  char* end;
+  int depth;
+} regex_parser;
+
+// the DFA states being built and a table to find them again by the NFA states they stand for
+typedef struct {
+  int* members;
+  int num_members;
+  int max_members;
+  int* member_offsets;
+  int* table;
+  int table_size;
+  int* marks;
+  int mark;
+  int* stack;
+} dfa_builder;
+
+static int  new_state(evweb_regex_set* set, enum evweb_nfa_type type);
+static int  parse_alternation(regex_parser* parser, nfa_fragment* fragment);
+static int  parse_concat(regex_parser* parser, nfa_fragment* fragment);
+static int  parse_repeat(regex_parser* parser, nfa_fragment* fragment);
+static int  parse_count(regex_parser* parser, int* min, int* max);
+static int  repeat_fragment(regex_parser* parser, char* from, char* to, int min, int max, nfa_fragment* fragment);
+static int  copy_fragment(regex_parser* parser, char* from, char* to, nfa_fragment* fragment);
+static int  parse_atom(regex_parser* parser, nfa_fragment* fragment);
+static int  parse_class(regex_parser* parser, unsigned char* bytes);
+static int  parse_escape(regex_parser* parser, unsigned char* bytes);
+static int  syntax_error(regex_parser* parser, char* problem);
+static void split_byte_classes(evweb_regex_set* set);
+static int  closure(evweb_regex_set* set, dfa_builder* builder, int* seeds, int num_seeds);
+static int  find_dfa_state(evweb_regex_set* set, dfa_builder* builder, int next);
+static void free_dfa(evweb_regex_set* set);
+
+// Regex routes are matched by one DFA built from all of them, so a request costs one table
+// lookup per byte of its path however many patterns there are. The syntax is the usual subset:
+// literals, ., [] classes, \d \w \s, groups, |, *, +, ? and {m,n}. Patterns are always anchored
+// at both ends, and since a DFA can't capture groups only group.
+evweb_regex_set* regex_set_create(void) {
+  evweb_regex_set* set;
+
+  set = calloc(1, sizeof (evweb_regex_set));
+  if (NULL == set)
+  {
+    print_err("failed to allocate memory for the regex set: %s\n", strerror(errno));
+    return NULL;
+  }
+  return set;
+}
+
+void regex_set_destroy(evweb_regex_set* set) {
+  free_dfa(set);
+  free(set->nfa);
+  free(set->starts);
+  free(set->positions);
+  free(set);
+}
+
+int regex_set_add(evweb_regex_set* set, char* pattern, int position) {
+  regex_parser parser;
+  nfa_fragment fragment;
+  int* starts;
+  int* positions;
+  int accept;
+
+  if (set->num_patterns >= set->max_patterns)
+  {
+    starts = realloc(set->starts, (set->max_patterns + 4) * 2 * sizeof (int));
+    if (NULL != starts)
+    {
+      set->starts = starts;
+    }
+    positions = realloc(set->positions, (set->max_patterns + 4) * 2 * sizeof (int));
+    if (NULL != positions)
+    {
+      set->positions = positions;
+    }
+    if ( (NULL == starts) || (NULL == positions) )
+    {
+      print_err("failed to allocate memory for the regex patterns: %s\n", strerror(errno));
+      return -1;
+    }
+    set->max_patterns = (set->max_patterns + 4) * 2;
+  }
+
+  parser.set = set;
+  parser.pattern = pattern;
+  parser.at = pattern;
+  parser.end = pattern + strlen(pattern);
+  parser.depth = 0;
+  // every pattern is anchored anyway, so anchors at the ends are only for readability
+  if ( (parser.at < parser.end) && ('^' == *parser.at) )
+  {
+    parser.at += 1;
+  }
+  if ( (parser.end > parser.at) && ('$' == parser.end[-1]) && ( (parser.end - 1 == parser.at) || ('\\' != parser.end[-2]) ) )
+  {
+    parser.end -= 1;
+  }
+
+  if (0 != parse_alternation(&parser, &fragment))
+  {
+    return -1;
+  }
+  if (parser.at < parser.end)
+  {
+    return syntax_error(&parser, "unmatched )");
+  }
+
+  accept = new_state(set, EVWEB_NFA_ACCEPT);
+  if (-1 == accept)
+  {
+    return -1;
+  }
+  set->nfa[accept].pattern = set->num_patterns;
+  set->nfa[fragment.end].out = accept;
+
+  set->starts[set->num_patterns] = fragment.start;
+  set->positions[set->num_patterns] = position;
+  set->num_patterns += 1;
+  print_debug("added pattern %s for callback %d, the NFA has %d states\n", pattern, position, set->nfa_length);
+  return 0;
+}
+
+// Build the DFA for every pattern added so far with the subset construction, each DFA state
+// standing for the NFA states that could be active after some path prefix.
+int regex_set_compile(evweb_regex_set* set) {
+  dfa_builder builder;
+  int* seeds;
+  int* transitions;
+  int* accept_offsets;
+  int* accepts;
+  int num_accepts = 0;
+  int state;
+  int class;
+  int rep[256];
+  int num_seeds;
+  int i;
+  int c;
+  int next;
+  int ret = -1;
+
+  free_dfa(set);
+  split_byte_classes(set);
+  for (c = 255; c >= 0; c -= 1)
+  {
+    rep[set->byte_class[c]] = c;
+  }
+
+  memset(&builder, 0, sizeof builder);
+  builder.table_size = 2 * EVWEB_REGEX_MAX_STATES;
+  builder.table = malloc(builder.table_size * sizeof (int));
+  builder.member_offsets = malloc((EVWEB_REGEX_MAX_STATES + 1) * sizeof (int));
+  builder.marks = calloc(set->nfa_length + 1, sizeof (int));
+  builder.stack = malloc((set->nfa_length + 1) * sizeof (int));
+  seeds = malloc((set->nfa_length + set->num_patterns + 1) * sizeof (int));
+  set->transitions = malloc(set->num_classes * sizeof (int));
+  set->accept_offsets = malloc((EVWEB_REGEX_MAX_STATES + 1) * sizeof (int));
+  set->accepts = malloc((set->num_patterns + 1) * sizeof (int));
+  if ( (NULL == builder.table) || (NULL == builder.member_offsets) || (NULL == builder.marks) || (NULL == builder.stack) ||
+       (NULL == seeds) || (NULL == set->transitions) || (NULL == set->accept_offsets) || (NULL == set->accepts) )
+  {
+    print_err("failed to allocate memory to compile the regex routes: %s\n", strerror(errno));
+    goto done;
+  }
+  memset(builder.table, -1, builder.table_size * sizeof (int));
+  builder.member_offsets[0] = 0;
+
+  // state 0 is the empty set every dead end leads to, 1 is where every pattern starts
+  if ( (0 != closure(set, &builder, NULL, 0)) || (0 != find_dfa_state(set, &builder, 0)) )
+  {
+    goto done;
+  }
+  if ( (0 != closure(set, &builder, set->starts, set->num_patterns)) || (-1 == find_dfa_state(set, &builder, set->num_states)) )
+  {
+    goto done;
+  }
+  if (1 == set->num_states)
+  {
+    // no patterns at all, give the start its own state anyway so it's always 1
+    set->num_states = 2;
+    builder.member_offsets[2] = builder.member_offsets[1];
+  }
+
+  for (state = 0; state < set->num_states; state += 1)
+  {
+    transitions = realloc(set->transitions, (size_t)(state + 1) * set->num_classes * sizeof (int));
+    if (NULL == transitions)
+    {
+      print_err("failed to allocate memory for the regex DFA: %s\n", strerror(errno));
+      goto done;
+    }
+    set->transitions = transitions;
+
+    // patterns went into the NFA in order, so their accept states come out sorted already
+    set->accept_offsets[state] = num_accepts;
+    for (i = builder.member_offsets[state]; i < builder.member_offsets[state + 1]; i += 1)
+    {
+      if (EVWEB_NFA_ACCEPT == set->nfa[builder.members[i]].type)
+      {
+        set->accepts[num_accepts] = set->positions[set->nfa[builder.members[i]].pattern];
+        num_accepts += 1;
+        accepts = realloc(set->accepts, (num_accepts + set->num_patterns + 1) * sizeof (int));
+        if (NULL == accepts)
+        {
+          print_err("failed to allocate memory for the regex DFA: %s\n", strerror(errno));
+          goto done;
+        }
+        set->accepts = accepts;
+      }
+    }
+
+    for (class = 0; class < set->num_classes; class += 1)
+    {
+      num_seeds = 0;
+      for (i = builder.member_offsets[state]; i < builder.member_offsets[state + 1]; i += 1)
+      {
+        if ( (EVWEB_NFA_SET == set->nfa[builder.members[i]].type) && has_byte(set->nfa[builder.members[i]].bytes, rep[class]) )
+        {
+          seeds[num_seeds] = set->nfa[builder.members[i]].out;
+          num_seeds += 1;
+        }
+      }
+      if (0 == num_seeds)
+      {
+        next = 0;
+      }
+      else
+      {
+        if (0 != closure(set, &builder, seeds, num_seeds))
+        {
+          goto done;
+        }
+        next = find_dfa_state(set, &builder, set->num_states);
+        if (-1 == next)
+        {
+          goto done;
+        }
+      }
+      set->transitions[state * set->num_classes + class] = next;
+    }
+  }
+  set->accept_offsets[set->num_states] = num_accepts;
+
+  accept_offsets = realloc(set->accept_offsets, (set->num_states + 1) * sizeof (int));
+  if (NULL != accept_offsets)
+  {
+    set->accept_offsets = accept_offsets;
+  }
+  print_debug("compiled %d patterns into %d DFA states over %d byte classes\n", set->num_patterns, set->num_states, set->num_classes);
+  ret = 0;
+
+done:
+  free(builder.members);
+  free(builder.member_offsets);
+  free(builder.table);
+  free(builder.marks);
+  free(builder.stack);
+  free(seeds);
+  if (0 != ret)
+  {
+    free_dfa(set);
+  }
+  return ret;
+}
+
+int* regex_set_match(evweb_regex_set* set, char* path, size_t path_length, int* count) {
+  int state = 1;
+  size_t i;
+
+  *count = 0;
+  if (NULL == set->transitions)
+  {
+    return NULL;
+  }
+
+  for (i = 0; i < path_length; i += 1)
+  {
+    state = set->transitions[state * set->num_classes + set->byte_class[(unsigned char)path[i]]];
+    if (0 == state)
+    {
+      return NULL;
+    }
+  }
+
+  *count = set->accept_offsets[state + 1] - set->accept_offsets[state];
+  return (0 == *count) ? NULL : set->accepts + set->accept_offsets[state];
+}
+
+static int new_state(evweb_regex_set* set, enum evweb_nfa_type type) {
+  evweb_nfa_state* nfa;
+  int capacity;
+
+  if (set->nfa_length >= set->nfa_capacity)
+  {
+    capacity = (0 == set->nfa_capacity) ? 64 : set->nfa_capacity * 2;
+    nfa = realloc(set->nfa, capacity * sizeof (evweb_nfa_state));
+    if (NULL == nfa)
+    {
+      print_err("failed to allocate memory for the regex NFA: %s\n", strerror(errno));
+      return -1;
+    }
+    set->nfa = nfa;
+    set->nfa_capacity = capacity;
+  }
+
+  memset(set->nfa + set->nfa_length, 0, sizeof (evweb_nfa_state));
+  set->nfa[set->nfa_length].type = type;
+  set->nfa[set->nfa_length].out = -1;
+  set->nfa[set->nfa_length].out1 = -1;
+  set->nfa_length += 1;
+  return set->nfa_length - 1;
+}
+
+static int parse_alternation(regex_parser* parser, nfa_fragment* fragment) {
+  evweb_regex_set* set = parser->set;
+  nfa_fragment left;
+  nfa_fragment right;
+  int split;
+  int join;
+
+  if (0 != parse_concat(parser, &left))
+  {
+    return -1;
+  }
+  while ( (parser->at < parser->end) && ('|' == *parser->at) )
+  {
+    parser->at += 1;
+    if (0 != parse_concat(parser, &right))
+    {
+      return -1;
+    }
+    split = new_state(set, EVWEB_NFA_SPLIT);
+    join = new_state(set, EVWEB_NFA_SPLIT);
+    if ( (-1 == split) || (-1 == join) )
+    {
+      return -1;
+    }
+    set->nfa[split].out = left.start;
+    set->nfa[split].out1 = right.start;
+    set->nfa[left.end].out = join;
+    set->nfa[right.end].out = join;
+    left.start = split;
+    left.end = join;
+  }
+
+  *fragment = left;
+  return 0;
+}
+
+static int parse_concat(regex_parser* parser, nfa_fragment* fragment) {
+  nfa_fragment next;
+  int empty;
+
+  // an empty piece (between two |s, or in a pair of parentheses) still needs a way through
+  empty = new_state(parser->set, EVWEB_NFA_SPLIT);
+  if (-1 == empty)
+  {
+    return -1;
+  }
+  fragment->start = empty;
+  fragment->end = empty;
+
+  while ( (parser->at < parser->end) && ('|' != *parser->at) && (')' != *parser->at) )
+  {
+    if (0 != parse_repeat(parser, &next))
+    {
+      return -1;
+    }
+    parser->set->nfa[fragment->end].out = next.start;
+    fragment->end = next.end;
+  }
+  return 0;
+}
+
+static int parse_repeat(regex_parser* parser, nfa_fragment* fragment) {
+  evweb_regex_set* set = parser->set;
+  char* atom = parser->at;
+  char* quantifier;
+  int split;
+  int join;
+  int min;
+  int max;
+
+  if (0 != parse_atom(parser, fragment))
+  {
+    return -1;
+  }
+
+  while ( (parser->at < parser->end) && (NULL != strchr("*+?{", *parser->at)) )
+  {
+    quantifier = parser->at;
+    if ('{' == *quantifier)
+    {
+      if ( (0 != parse_count(parser, &min, &max)) || (0 != repeat_fragment(parser, atom, quantifier, min, max, fragment)) )
+      {
+        return -1;
+      }
+      continue;
+    }
+
+    parser->at += 1;
+    split = new_state(set, EVWEB_NFA_SPLIT);
+    join = new_state(set, EVWEB_NFA_SPLIT);
+    if ( (-1 == split) || (-1 == join) )
+    {
+      return -1;
+    }
+    set->nfa[split].out = fragment->start;
+    set->nfa[split].out1 = join;
+    // * and + loop back to try again, ? and * can skip it altogether
+    set->nfa[fragment->end].out = ('?' == *quantifier) ? join : split;
+    if ('+' != *quantifier)
+    {
+      fragment->start = split;
+    }
+    fragment->end = join;
+  }
+  return 0;
+}
+
+static int parse_count(regex_parser* parser, int* min, int* max) {
+  char* after;
+  long value;
+
+  parser->at += 1;
+  value = strtol(parser->at, &after, 10);
+  if ( (after == parser->at) || (value < 0) || (value > EVWEB_REGEX_MAX_REPEAT) )
+  {
+    return syntax_error(parser, "bad repeat count");
+  }
+  *min = value;
+  *max = value;
+  parser->at = after;
+
+  if ( (parser->at < parser->end) && (',' == *parser->at) )
+  {
+    parser->at += 1;
+    *max = -1;
+    if ( (parser->at < parser->end) && ('}' != *parser->at) )
+    {
+      value = strtol(parser->at, &after, 10);
+      if ( (after == parser->at) || (value < *min) || (value > EVWEB_REGEX_MAX_REPEAT) )
+      {
+        return syntax_error(parser, "bad repeat count");
+      }
+      *max = value;
+      parser->at = after;
+    }
+  }
+
+  if ( (parser->at >= parser->end) || ('}' != *parser->at) )
+  {
+    return syntax_error(parser, "unterminated repeat count");
+  }
+  parser->at += 1;
+  return 0;
+}
+
+// Turn the fragment parsed from the pattern between from and to into min required copies of
+// it followed by max - min optional ones, or a loop when max is -1. Each copy comes from
+// parsing the same text again.
+static int repeat_fragment(regex_parser* parser, char* from, char* to, int min, int max, nfa_fragment* fragment) {
+  evweb_regex_set* set = parser->set;
+  nfa_fragment result;
+  nfa_fragment copy;
+  int split;
+  int join;
+  int i;
+
+  result.start = new_state(set, EVWEB_NFA_SPLIT);
+  if (-1 == result.start)
+  {
+    return -1;
+  }
+  result.end = result.start;
+
+  for (i = 0; (i < max) || ( (-1 == max) && (i <= min) ); i += 1)
+  {
+    if (0 == i)
+    {
+      copy = *fragment;
+    }
+    else if (0 != copy_fragment(parser, from, to, &copy))
+    {
+      return -1;
+    }
+
+    if (i >= min)
+    {
+      split = new_state(set, EVWEB_NFA_SPLIT);
+      join = new_state(set, EVWEB_NFA_SPLIT);
+      if ( (-1 == split) || (-1 == join) )
+      {
+        return -1;
+      }
+      set->nfa[split].out = copy.start;
+      set->nfa[split].out1 = join;
+      set->nfa[copy.end].out = (-1 == max) ? split : join;
+      copy.start = split;
+      copy.end = join;
+    }
+    set->nfa[result.end].out = copy.start;
+    result.end = copy.end;
+  }
+
+  *fragment = result;
+  return 0;
+}
+
+static int copy_fragment(regex_parser* parser, char* from, char* to, nfa_fragment* fragment) {
+  regex_parser copy = *parser;
+
+  copy.at = from;
+  copy.end = to;
+  return parse_repeat(&copy, fragment);
+}
+
+static int parse_atom(regex_parser* parser, nfa_fragment* fragment) {
+  evweb_regex_set* set = parser->set;
+  unsigned char bytes[32];
+  char c = *parser->at;
+  int state;
+
+  if ('(' == c)
+  {
+    parser->at += 1;
+    if ( (parser->end - parser->at >= 2) && (0 == strncmp(parser->at, "?:", 2)) )
+    {
+      parser->at += 2;
+    }
+    parser->depth += 1;
+    if (parser->depth > EVWEB_REGEX_MAX_DEPTH)
+    {
+      return syntax_error(parser, "groups nested too deeply");
+    }
+    if (0 != parse_alternation(parser, fragment))
+    {
+      return -1;
+    }
+    parser->depth -= 1;
+    if ( (parser->at >= parser->end) || (')' != *parser->at) )
+    {
+      return syntax_error(parser, "unmatched (");
+    }
+    parser->at += 1;
+    return 0;
+  }
+  if (NULL != strchr(")*+?{|^$", c))
+  {
+    return syntax_error(parser, "unexpected character");
+  }
+
+  memset(bytes, 0, sizeof bytes);
+  if ('[' == c)
+  {
+    if (0 != parse_class(parser, bytes))
+    {
+      return -1;
+    }
+  }
+  else if ('.' == c)
+  {
+    memset(bytes, 0xff, sizeof bytes);
+    parser->at += 1;
+  }
+  else if ('\\' == c)
+  {
+    if (-1 == parse_escape(parser, bytes))
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    add_byte(bytes, (unsigned char)c);
+    parser->at += 1;
+  }
+
+  state = new_state(set, EVWEB_NFA_SET);
+  if (-1 == state)
+  {
+    return -1;
+  }
+  memcpy(set->nfa[state].bytes, bytes, sizeof bytes);
+  fragment->start = state;
+  fragment->end = state;
+  return 0;
+}
+
+static int parse_class(regex_parser* parser, unsigned char* bytes) {
+  unsigned char item[32];
+  bool negate = false;
+  bool first = true;
+  int low;
+  int high;
+  int c;
+  int i;
+
+  parser->at += 1;
+  if ( (parser->at < parser->end) && ('^' == *parser->at) )
+  {
+    negate = true;
+    parser->at += 1;
+  }
+
+  while (true)
+  {
+    if (parser->at >= parser->end)
+    {
+      return syntax_error(parser, "unterminated [");
+    }
+    if ( (']' == *parser->at) && (false == first) )
+    {
+      parser->at += 1;
+      break;
+    }
+    first = false;
+
+    memset(item, 0, sizeof item);
+    if ('\\' == *parser->at)
+    {
+      low = parse_escape(parser, item);
+      if (-1 == low)
+      {
+        return -1;
+      }
+    }
+    else
+    {
+      low = (unsigned char)*parser->at;
+      add_byte(item, low);
+      parser->at += 1;
+    }
+
+    // a range runs between two single characters, a - anywhere else is just a -
+    if ( (-2 != low) && (parser->end - parser->at >= 2) && ('-' == parser->at[0]) && (']' != parser->at[1]) )
+    {
+      parser->at += 1;
+      if ('\\' == *parser->at)
+      {
+        high = parse_escape(parser, item);
+        if (-1 == high)
+        {
+          return -1;
+        }
+      }
+      else
+      {
+        high = (unsigned char)*parser->at;
+        parser->at += 1;
+      }
+      if ( (-2 == high) || (high < low) )
+      {
+        return syntax_error(parser, "bad range in []");
+      }
+      for (c = low; c <= high; c += 1)
+      {
+        add_byte(item, c);
+      }
+    }
+
+    for (i = 0; i < 32; i += 1)
+    {
+      bytes[i] |= item[i];
+    }
+  }
+
+  if (true == negate)
+  {
+    for (i = 0; i < 32; i += 1)
+    {
+      bytes[i] = ~bytes[i];
+    }
+  }
+  return 0;
+}
+
+// Add what the escape at parser->at stands for to bytes. Returns the byte when it's a single
+// one, -2 for a class like \d and -1 on an error
+static int parse_escape(regex_parser* parser, unsigned char* bytes) {
+  unsigned char class[32];
+  int c;
+  int i;
+
+  parser->at += 1;
+  if (parser->at >= parser->end)
+  {
+    return syntax_error(parser, "trailing \\");
+  }
+  c = (unsigned char)*parser->at;
+  parser->at += 1;
+
+  memset(class, 0, sizeof class);
+  switch (c)
+  {
+    case 'd': case 'D':
+      for (i = '0'; i <= '9'; i += 1)
+      {
+        add_byte(class, i);
+      }
+      break;
+    case 'w': case 'W':
+      for (i = 0; i < 256; i += 1)
+      {
+        if ( ((i >= 'a') && (i <= 'z')) || ((i >= 'A') && (i <= 'Z')) || ((i >= '0') && (i <= '9')) || ('_' == i) )
+        {
+          add_byte(class, i);
+        }
+      }
+      break;
+    case 's': case 'S':
+      add_byte(class, ' ');
+      add_byte(class, '\t');
+      add_byte(class, '\n');
+      add_byte(class, '\r');
+      add_byte(class, '\f');
+      add_byte(class, '\v');
+      break;
+    case 'n':
+      add_byte(bytes, '\n');
+      return '\n';
+    case 't':
+      add_byte(bytes, '\t');
+      return '\t';
+    default:
+      add_byte(bytes, c);
+      return c;
+  }
+
+  for (i = 0; i < 32; i += 1)
+  {
+    bytes[i] |= ( (c >= 'A') && (c <= 'Z') ) ? ~class[i] : class[i];
+  }
+  return -2;
+}
+
+static int syntax_error(regex_parser* parser, char* problem) {
+  print_err("%s at offset %d of regex route %s\n", problem, (int)(parser->at - parser->pattern), parser->pattern);
+  errno = EINVAL;
+  return -1;
+}
+
+// Sort the bytes into classes that every SET state treats alike, so the DFA needs one transition
+// per class rather than one per byte. Each state's bytes split the classes found so far in two.
+static void split_byte_classes(evweb_regex_set* set) {
+  int renumber[512];
+  int num_classes = 1;
+  int key;
+  int c;
+  int i;
+
+  memset(set->byte_class, 0, sizeof set->byte_class);
+  for (i = 0; i < set->nfa_length; i += 1)
+  {
+    if (EVWEB_NFA_SET != set->nfa[i].type)
+    {
+      continue;
+    }
+
+    memset(renumber, -1, sizeof renumber);
+    num_classes = 0;
+    for (c = 0; c < 256; c += 1)
+    {
+      key = set->byte_class[c] * 2 + (has_byte(set->nfa[i].bytes, c) ? 1 : 0);
+      if (-1 == renumber[key])
+      {
+        renumber[key] = num_classes;
+        num_classes += 1;
+      }
+      set->byte_class[c] = renumber[key];
+    }
+  }
+  set->num_classes = num_classes;
+}
+
+// Follow every SPLIT from seeds and leave the SET and ACCEPT states reached, in order, as a new
+// candidate state at the end of the builder's members.
+static int closure(evweb_regex_set* set, dfa_builder* builder, int* seeds, int num_seeds) {
+  int* members;
+  int first = builder->num_members;
+  int depth = 0;
+  int state;
+  int next;
+  int i;
+  int j;
+
+  builder->mark += 1;
+  for (i = 0; i < num_seeds; i += 1)
+  {
+    if ( (-1 != seeds[i]) && (builder->mark != builder->marks[seeds[i]]) )
+    {
+      builder->marks[seeds[i]] = builder->mark;
+      builder->stack[depth] = seeds[i];
+      depth += 1;
+    }
+  }
+
+  while (depth > 0)
+  {
+    depth -= 1;
+    state = builder->stack[depth];
+    if (EVWEB_NFA_SPLIT != set->nfa[state].type)
+    {
+      if (builder->num_members >= builder->max_members)
+      {
+        members = realloc(builder->members, (builder->max_members + 64) * 2 * sizeof (int));
+        if (NULL == members)
+        {
+          print_err("failed to allocate memory to compile the regex routes: %s\n", strerror(errno));
+          return -1;
+        }
+        builder->members = members;
+        builder->max_members = (builder->max_members + 64) * 2;
+      }
+      builder->members[builder->num_members] = state;
+      builder->num_members += 1;
+      continue;
+    }
+
+    for (j = 0; j < 2; j += 1)
+    {
+      next = (0 == j) ? set->nfa[state].out : set->nfa[state].out1;
+      if ( (-1 != next) && (builder->mark != builder->marks[next]) )
+      {
+        builder->marks[next] = builder->mark;
+        builder->stack[depth] = next;
+        depth += 1;
+      }
+    }
+  }
+
+  // sort so the same set always looks the same, insertion sort does for the sizes we see
+  members = builder->members + first;
+  for (i = 1; i < builder->num_members - first; i += 1)
+  {
+    state = members[i];
+    for (j = i; (j > 0) && (members[j - 1] > state); j -= 1)
+    {
+      members[j] = members[j - 1];
+    }
+    members[j] = state;
+  }
+  return 0;
+}
+
+// The DFA state for the set closure just left at the end of the members. A set we've seen before
+// is dropped again, a new one becomes state next. Returns -1 when there are too many states
+static int find_dfa_state(evweb_regex_set* set, dfa_builder* builder, int next) {
+  int first = builder->member_offsets[set->num_states];
+  int length = builder->num_members - first;
+  int* members = builder->members + first;
+  uint32_t hash = 2166136261u;
+  int other;
+  int slot;
+  int i;
+
+  for (i = 0; i < length; i += 1)
+  {
+    hash = (hash ^ (uint32_t)members[i]) * 16777619u;
+  }
+
+  for (slot = hash & (builder->table_size - 1); -1 != builder->table[slot]; slot = (slot + 1) & (builder->table_size - 1))
+  {
+    other = builder->table[slot];
+    if ( (builder->member_offsets[other + 1] - builder->member_offsets[other] == length) &&
+         ( (0 == length) || (0 == memcmp(builder->members + builder->member_offsets[other], members, length * sizeof (int))) ) )
+    {
+      builder->num_members = first;
+      return other;
+    }
+  }
+
+  if (set->num_states >= EVWEB_REGEX_MAX_STATES)
+  {
+    print_err("the regex routes need more than %d DFA states, simplify them or use fewer\n", EVWEB_REGEX_MAX_STATES);
+    errno = E2BIG;
+    return -1;
+  }
+  builder->table[slot] = next;
+  set->num_states += 1;
+  builder->member_offsets[set->num_states] = builder->num_members;
+  return next;
+}
+
+static void free_dfa(evweb_regex_set* set) {
+  free(set->transitions);
+  free(set->accept_offsets);
+  free(set->accepts);
+  set->transitions = NULL;
+  set->accept_offsets = NULL;
+  set->accepts = NULL;
+  set->num_states = 0;
+}
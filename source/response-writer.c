@@ -0,0 +1,924 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include <evn.h>
+
+#include "evweb.h"
+#include "body-segment.h"
+#include "processer-pool.h"
+#include "response-writer.h"
+
+#ifndef DEBUG_RESPONSE_WRITER
+  #ifdef DEBUG
+    #define DEBUG_RESPONSE_WRITER 1
+  #else
+    #define DEBUG_RESPONSE_WRITER 0
+  #endif
+#endif
+
+#if DEBUG_RESPONSE_WRITER
+  #define print_debug(...) printf("[response-writer] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[response-writer] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[response-writer] " __VA_ARGS__)
+
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif
+
+typedef struct {
+  char* line;
+  size_t length;
+} evweb_status_line;
+
+#define STATUS_LINE(code, reason) [code] = { "HTTP/1.1 " #code " " reason "\r\n", sizeof ("HTTP/1.1 " #code " " reason "\r\n") - 1 }
+
+// every status line we know the reason phrase for, ready to be copied straight into a response
+static const evweb_status_line status_lines[] = {
+  STATUS_LINE(100, "Continue"),
+  STATUS_LINE(101, "Switching Protocols"),
+  STATUS_LINE(102, "Processing"),
+  STATUS_LINE(103, "Early Hints"),
+  STATUS_LINE(200, "OK"),
+  STATUS_LINE(201, "Created"),
+  STATUS_LINE(202, "Accepted"),
+  STATUS_LINE(203, "Non-Authoritative Information"),
+  STATUS_LINE(204, "No Content"),
+  STATUS_LINE(205, "Reset Content"),
+  STATUS_LINE(206, "Partial Content"),
+  STATUS_LINE(207, "Multi-Status"),
+  STATUS_LINE(208, "Already Reported"),
+  STATUS_LINE(226, "IM Used"),
+  STATUS_LINE(300, "Multiple Choices"),
+  STATUS_LINE(301, "Moved Permanently"),
+  STATUS_LINE(302, "Found"),
+  STATUS_LINE(303, "See Other"),
+  STATUS_LINE(304, "Not Modified"),
+  STATUS_LINE(305, "Use Proxy"),
+  STATUS_LINE(307, "Temporary Redirect"),
+  STATUS_LINE(308, "Permanent Redirect"),
+  STATUS_LINE(400, "Bad Request"),
+  STATUS_LINE(401, "Unauthorized"),
+  STATUS_LINE(402, "Payment Required"),
+  STATUS_LINE(403, "Forbidden"),
+  STATUS_LINE(404, "Not Found"),
+  STATUS_LINE(405, "Method Not Allowed"),
+  STATUS_LINE(406, "Not Acceptable"),
+  STATUS_LINE(407, "Proxy Authentication Required"),
+  STATUS_LINE(408, "Request Timeout"),
+  STATUS_LINE(409, "Conflict"),
+  STATUS_LINE(410, "Gone"),
+  STATUS_LINE(411, "Length Required"),
+  STATUS_LINE(412, "Precondition Failed"),
+  STATUS_LINE(413, "Payload Too Large"),
+  STATUS_LINE(414, "URI Too Long"),
+  STATUS_LINE(415, "Unsupported Media Type"),
+  STATUS_LINE(416, "Range Not Satisfiable"),
+  STATUS_LINE(417, "Expectation Failed"),
+  STATUS_LINE(421, "Misdirected Request"),
+  STATUS_LINE(422, "Unprocessable Entity"),
+  STATUS_LINE(423, "Locked"),
+  STATUS_LINE(424, "Failed Dependency"),
+  STATUS_LINE(425, "Too Early"),
+  STATUS_LINE(426, "Upgrade Required"),
+  STATUS_LINE(428, "Precondition Required"),
+  STATUS_LINE(429, "Too Many Requests"),
+  STATUS_LINE(431, "Request Header Fields Too Large"),
+  STATUS_LINE(451, "Unavailable For Legal Reasons"),
+  STATUS_LINE(500, "Internal Server Error"),
+  STATUS_LINE(501, "Not Implemented"),
+  STATUS_LINE(502, "Bad Gateway"),
+  STATUS_LINE(503, "Service Unavailable"),
+  STATUS_LINE(504, "Gateway Timeout"),
+  STATUS_LINE(505, "HTTP Version Not Supported"),
+  STATUS_LINE(506, "Variant Also Negotiates"),
+  STATUS_LINE(507, "Insufficient Storage"),
+  STATUS_LINE(508, "Loop Detected"),
+  STATUS_LINE(510, "Not Extended"),
+  STATUS_LINE(511, "Network Authentication Required"),
+};
+
+#define NUM_STATUS_LINES ((int)(sizeof status_lines / sizeof status_lines[0]))
+
+static void refresh_date_header(evweb_worker* worker);
+static bool has_header(evweb_response* response, char* field);
+static size_t format_size(char* out, size_t value);
+static size_t format_hex(char* out, size_t value);
+static char* reserve_output(evweb_exchange* exchange, size_t length);
+static evweb_output_part* next_output_part(evweb_exchange* exchange);
+static struct iovec* reserve_iov(evweb_http_processer* processer, int count);
+static ssize_t write_iov(struct evn_stream* stream, struct iovec* iov, int count);
+static bool consume_output(evweb_http_processer* processer, size_t written);
+static bool send_file_part(evweb_http_processer* processer, struct evn_stream* stream, evweb_output_part* part);
+static void wait_for_writable(evweb_http_processer* processer, struct evn_stream* stream);
+static void on_writable(EV_P, ev_io* watcher, int revents);
+static void release_sent_parts(evweb_worker* worker, evweb_exchange* exchange, int count);
+static void release_part(evweb_worker* worker, evweb_output_part* part);
+
+// Serialize the status line and headers into the exchange's output buffer and queue them, with
+// the body, as parts of the exchange's output. Lengths are all worked out up front so nothing
+// is ever truncated, and the body is handed over rather than copied.
+int queue_response(evweb_exchange* exchange, evweb_response* response) {
+  evweb_http_processer* processer = (evweb_http_processer*)response->connection->send_data;
+  evweb_worker* worker = processer->worker;
+  int i;
+  const evweb_status_line* status_line = NULL;
+  char* message = NULL;
+  char status[16];
+  size_t status_len = 0;
+  char length[32];
+  size_t length_len = 0;
+  size_t message_len = 0;
+  bool send_date;
+  size_t head_length;
+  char* head;
+  char* cur_pos;
+  bool send_length;
+  evweb_header_line* current_line;
+  evweb_output_part* part;
+  evweb_body_segment* segment;
+  int fd;
+
+  if ( (NULL == response->status_message) && (response->status >= 0) && (response->status < NUM_STATUS_LINES) )
+  {
+    status_line = status_lines + response->status;
+  }
+  if ( (NULL == status_line) || (NULL == status_line->line) )
+  {
+    // a custom reason phrase or a status we don't know, so the line has to be put together
+    status_line = NULL;
+    message = (NULL == response->status_message) ? "" : response->status_message;
+    message_len = strlen(message);
+    status_len = format_size(status, (size_t)response->status);
+  }
+
+  // the handler gets the last word if it set its own Date
+  send_date = ( (response->status >= 200) && (false == has_header(response, "Date")) );
+  if (true == send_date)
+  {
+    refresh_date_header(worker);
+  }
+
+  // persistent connections need every response framed, so send a length even when it's 0
+  // a streamed body is framed by chunks, or by the connection closing
+  send_length = ( (false == exchange->streaming) && (response->status >= 200) && (204 != response->status) && (304 != response->status) );
+  if (true == send_length)
+  {
+    length_len = format_size(length, response->content_length);
+  }
+
+  if (NULL != status_line)
+  {
+    head_length = status_line->length;
+  }
+  else
+  {
+    head_length = strlen("HTTP/1.1 ") + status_len + 1 + message_len + 2;
+  }
+  if (true == send_date)
+  {
+    head_length += worker->date_header_length;
+  }
+  current_line = response->header_lines;
+  for (i = 0; i < response->num_header_lines; i += 1)
+  {
+    head_length += current_line->field_len + 2 + current_line->value_len + 2;
+    current_line += 1;
+  }
+  if (true == send_length)
+  {
+    head_length += strlen("Content-Length: ") + length_len + 2;
+  }
+  if (true == exchange->chunked)
+  {
+    head_length += strlen("Transfer-Encoding: chunked\r\n");
+  }
+  if (NULL != response->content_type)
+  {
+    head_length += strlen("Content-Type: ") + strlen(response->content_type) + 2;
+  }
+  head_length += 2;
+
+  head = reserve_output(exchange, head_length);
+  part = next_output_part(exchange);
+  if ( (NULL == head) || (NULL == part) )
+  {
+    return errno;
+  }
+
+  cur_pos = head;
+  #define APPEND(str, len) do { memcpy(cur_pos, (str), (len)); cur_pos += (len); } while (0)
+  if (NULL != status_line)
+  {
+    APPEND(status_line->line, status_line->length);
+  }
+  else
+  {
+    APPEND("HTTP/1.1 ", strlen("HTTP/1.1 "));
+    APPEND(status, status_len);
+    APPEND(" ", 1);
+    APPEND(message, message_len);
+    APPEND("\r\n", 2);
+  }
+  if (true == send_date)
+  {
+    APPEND(worker->date_header, worker->date_header_length);
+  }
+
+  current_line = response->header_lines;
+  for (i = 0; i < response->num_header_lines; i += 1)
+  {
+    APPEND(current_line->field, current_line->field_len);
+    APPEND(": ", 2);
+    APPEND(current_line->value, current_line->value_len);
+    APPEND("\r\n", 2);
+    current_line += 1;
+  }
+  if (true == send_length)
+  {
+    APPEND("Content-Length: ", strlen("Content-Length: "));
+    APPEND(length, length_len);
+    APPEND("\r\n", 2);
+  }
+  if (true == exchange->chunked)
+  {
+    APPEND("Transfer-Encoding: chunked\r\n", strlen("Transfer-Encoding: chunked\r\n"));
+  }
+  if (NULL != response->content_type)
+  {
+    APPEND("Content-Type: ", strlen("Content-Type: "));
+    APPEND(response->content_type, strlen(response->content_type));
+    APPEND("\r\n", 2);
+  }
+  APPEND("\r\n", 2);
+  #undef APPEND
+
+  // the head lives in the output buffer, which may still move, so remember where rather than a pointer
+  part->offset = head - exchange->output;
+  part->length = head_length;
+  exchange->output_length += head_length;
+
+  // the answer to HEAD describes the body without sending it
+  if (HTTP_HEAD == exchange->request.method)
+  {
+    if (NULL != response->body)
+    {
+      release_segment_chain(worker, response->body);
+      response->body = NULL;
+    }
+    if ( (NULL != response->body_ref) && (NULL != response->body_release) )
+    {
+      response->body_release(response->body_release_ctx, response->body_ref);
+    }
+    response->body_ref = NULL;
+    response->body_release = NULL;
+    response->body_release_ctx = NULL;
+    if (-1 != response->body_fd)
+    {
+      close(response->body_fd);
+      response->body_fd = -1;
+    }
+  }
+
+  // take the body's segments over from the response, each goes back to the pool (or to whoever
+  // lent it) once written
+  while (NULL != response->body)
+  {
+    segment = response->body;
+    if (0 == segment->length)
+    {
+      response->body = segment->next;
+      release_segment(worker, segment);
+      continue;
+    }
+    part = next_output_part(exchange);
+    if (NULL == part)
+    {
+      return errno;
+    }
+    response->body = segment->next;
+    segment->next = NULL;
+
+    part->data = segment_bytes(segment);
+    part->offset = 0;
+    part->length = segment->length;
+    part->segment = segment;
+    exchange->output_length += segment->length;
+  }
+  response->body_last = NULL;
+
+  // a lent body goes out as it is, and is handed back once it's been written
+  if (NULL != response->body_ref)
+  {
+    part = next_output_part(exchange);
+    if (NULL == part)
+    {
+      return errno;
+    }
+    part->data = response->body_ref;
+    part->offset = 0;
+    part->length = response->content_length;
+    part->release = response->body_release;
+    part->release_ctx = response->body_release_ctx;
+    exchange->output_length += response->content_length;
+    response->body_ref = NULL;
+    response->body_release = NULL;
+    response->body_release_ctx = NULL;
+  }
+
+  // a file body is sent straight from its fd, which is closed once it's all gone out
+  if (-1 != response->body_fd)
+  {
+    fd = response->body_fd;
+    response->body_fd = -1;
+    if (0 != queue_file(exchange, fd, response->body_fd_offset, response->content_length))
+    {
+      return errno;
+    }
+  }
+  response->content_length = 0;
+
+  print_debug("queued %zu byte head and %d parts for exchange %u\n", head_length, exchange->num_parts, exchange->seq);
+  return 0;
+}
+
+// copy bytes to the end of what the exchange has waiting to be written
+int queue_output(evweb_exchange* exchange, void* data, size_t length) {
+  char* output;
+  evweb_output_part* part;
+
+  if (0 == length)
+  {
+    return 0;
+  }
+
+  output = reserve_output(exchange, length);
+  part = next_output_part(exchange);
+  if ( (NULL == output) || (NULL == part) )
+  {
+    return errno;
+  }
+  memcpy(output, data, length);
+
+  part->offset = output - exchange->output;
+  part->length = length;
+  exchange->output_length += length;
+  return 0;
+}
+
+// queue length bytes of a file to be sent from offset with sendfile. The exchange owns fd now
+int queue_file(evweb_exchange* exchange, int fd, off_t offset, size_t length) {
+  evweb_output_part* part;
+
+  part = next_output_part(exchange);
+  if (NULL == part)
+  {
+    close(fd);
+    return errno;
+  }
+
+  part->fd = fd;
+  part->file_offset = offset;
+  part->length = length;
+  exchange->output_length += length;
+  return 0;
+}
+
+// queue data framed as a single chunk: its size in hex, the data, then a CRLF
+int queue_chunk(evweb_exchange* exchange, void* data, size_t length) {
+  char size[32];
+  size_t size_len;
+  char* output;
+  evweb_output_part* part;
+
+  size_len = format_hex(size, length);
+  output = reserve_output(exchange, size_len + 2 + length + 2);
+  part = next_output_part(exchange);
+  if ( (NULL == output) || (NULL == part) )
+  {
+    return errno;
+  }
+
+  part->offset = output - exchange->output;
+  part->length = size_len + 2 + length + 2;
+  exchange->output_length += part->length;
+
+  memcpy(output, size, size_len);
+  output += size_len;
+  memcpy(output, "\r\n", 2);
+  output += 2;
+  memcpy(output, data, length);
+  output += length;
+  memcpy(output, "\r\n", 2);
+  return 0;
+}
+
+// Write out every response that is ready, in request order. The oldest exchange's output can
+// always go, and the ones behind it can follow as soon as everything ahead of them has ended.
+// Everything in memory up to the next file is handed to the socket as one gathered write, then
+// the file is sent with sendfile as fast as the socket will take it. Whatever the socket won't
+// take stays queued where it is, and on_writable carries on from there once it drains.
+bool flush_exchanges(evweb_http_processer* processer) {
+  struct evn_stream* stream = (struct evn_stream*)processer->parser.data;
+  evweb_exchange* exchange;
+  evweb_exchange* file_exchange;
+  evweb_output_part* file_part;
+  evweb_output_part* part;
+  int num_iov;
+  int i;
+  ssize_t written;
+  bool keep_alive;
+
+  if (true == processer->write_pending)
+  {
+    // the socket is full, everything has to wait its turn behind what's already queued
+    return false;
+  }
+
+  while (NULL != processer->exchanges)
+  {
+    num_iov = 0;
+    file_part = NULL;
+    file_exchange = NULL;
+    for (exchange = processer->exchanges; NULL != exchange; exchange = exchange->next)
+    {
+      for (i = exchange->sent_parts; i < exchange->num_parts; i += 1)
+      {
+        part = exchange->parts + i;
+        if (-1 != part->fd)
+        {
+          file_part = part;
+          file_exchange = exchange;
+          break;
+        }
+        if (NULL == reserve_iov(processer, num_iov + 1))
+        {
+          return false;
+        }
+        processer->iov[num_iov].iov_base = ((NULL == part->data) ? exchange->output : part->data) + part->offset;
+        processer->iov[num_iov].iov_len = part->length;
+        num_iov += 1;
+      }
+      if ( (NULL != file_part) || (false == exchange->ended) || (false == exchange->keep_alive) )
+      {
+        break;
+      }
+    }
+
+    if (num_iov > 0)
+    {
+      written = write_iov(stream, processer->iov, num_iov);
+      if (-1 == written)
+      {
+        return false;
+      }
+      if (false == consume_output(processer, written))
+      {
+        wait_for_writable(processer, stream);
+        return false;
+      }
+    }
+
+    if (NULL != file_part)
+    {
+      if (false == send_file_part(processer, stream, file_part))
+      {
+        return false;
+      }
+      release_sent_parts(processer->worker, file_exchange, file_exchange->sent_parts + 1);
+    }
+
+    // recycle the exchanges that are done and completely written
+    while ( (NULL != processer->exchanges) && (true == processer->exchanges->ended) &&
+            (processer->exchanges->sent_parts == processer->exchanges->num_parts) )
+    {
+      keep_alive = processer->exchanges->keep_alive;
+      retire_exchange(processer);
+      if (false == keep_alive)
+      {
+        // nothing after the connection's last response will ever be sent
+        while (NULL != processer->exchanges)
+        {
+          retire_exchange(processer);
+        }
+
+        print_debug("closing connection\n");
+        evn_stream_end(stream->EV_A, stream);
+        return true;
+      }
+    }
+    if ( (NULL != processer->exchanges) && (processer->exchanges->sent_parts == processer->exchanges->num_parts) )
+    {
+      // the oldest exchange isn't done yet, but what it has queued so far has all gone
+      clear_output_parts(processer->worker, processer->exchanges);
+    }
+
+    if (NULL == file_part)
+    {
+      break;
+    }
+  }
+
+  return true;
+}
+
+// forget the exchange's queued output, handing back the body memory it had taken over
+void clear_output_parts(evweb_worker* worker, evweb_exchange* exchange) {
+  int i;
+
+  // the sent ones were handed back as they went out, the rest are given up on unwritten
+  for (i = exchange->sent_parts; i < exchange->num_parts; i += 1)
+  {
+    release_part(worker, exchange->parts + i);
+  }
+  exchange->num_parts = 0;
+  exchange->sent_parts = 0;
+  exchange->output_length = 0;
+}
+
+static const char* day_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char* month_names[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+// Write time as an HTTP date (Sun, 06 Nov 1994 08:49:37 GMT), spelled out by hand since
+// strftime's %a and %b follow the locale. Returns the length like snprintf does.
+size_t format_http_date(char* out, size_t size, time_t time) {
+  struct tm tm;
+
+  gmtime_r(&time, &tm);
+  return snprintf(out, size, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                  day_names[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon], tm.tm_year + 1900,
+                  tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+// read back a date in the format above. The obsolete formats HTTP/1.1 still allows clients to
+// send are rare enough that not understanding them is fine, the caller ignores the header
+bool parse_http_date(char* date, time_t* time) {
+  char month[4];
+  struct tm tm;
+  int i;
+
+  memset(&tm, 0, sizeof tm);
+  if (6 != sscanf(date, "%*[A-Za-z], %2d %3s %4d %2d:%2d:%2d GMT", &(tm.tm_mday), month, &(tm.tm_year), &(tm.tm_hour), &(tm.tm_min), &(tm.tm_sec)))
+  {
+    return false;
+  }
+  for (i = 0; i < 12; i += 1)
+  {
+    if (0 == strcmp(month, month_names[i]))
+    {
+      break;
+    }
+  }
+  if (12 == i)
+  {
+    return false;
+  }
+  tm.tm_mon = i;
+  tm.tm_year -= 1900;
+
+  *time = timegm(&tm);
+  return (-1 != *time);
+}
+
+// Format the Date header at most once a second. ev_now is the time the loop last woke up,
+// which is plenty accurate for a header with one second resolution and costs no syscall.
+static void refresh_date_header(evweb_worker* worker) {
+  ev_tstamp now = ev_now(worker->EV_A);
+  time_t seconds;
+  size_t length;
+
+  if ( (0 != worker->date_header_length) && (now - worker->date_header_time < 1) && (now >= worker->date_header_time) )
+  {
+    return;
+  }
+
+  seconds = (time_t)now;
+  length = strlen("Date: ");
+  memcpy(worker->date_header, "Date: ", length);
+  length += format_http_date(worker->date_header + length, sizeof worker->date_header - length, seconds);
+  memcpy(worker->date_header + length, "\r\n", 2);
+  worker->date_header_length = length + 2;
+  worker->date_header_time = (ev_tstamp)seconds;
+}
+
+static bool has_header(evweb_response* response, char* field) {
+  int i;
+
+  for (i = 0; i < response->num_header_lines; i += 1)
+  {
+    if (0 == strcasecmp(response->header_lines[i].field, field))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// print a number in decimal without going through snprintf, returning how many digits it took
+static size_t format_size(char* out, size_t value) {
+  char digits[32];
+  size_t num_digits = 0;
+  size_t i;
+
+  do
+  {
+    digits[num_digits] = '0' + (value % 10);
+    num_digits += 1;
+    value /= 10;
+  } while (value > 0);
+
+  for (i = 0; i < num_digits; i += 1)
+  {
+    out[i] = digits[num_digits - i - 1];
+  }
+  return num_digits;
+}
+
+static size_t format_hex(char* out, size_t value) {
+  static const char hex_digits[] = "0123456789abcdef";
+  char digits[32];
+  size_t num_digits = 0;
+  size_t i;
+
+  do
+  {
+    digits[num_digits] = hex_digits[value & 0xf];
+    num_digits += 1;
+    value >>= 4;
+  } while (value > 0);
+
+  for (i = 0; i < num_digits; i += 1)
+  {
+    out[i] = digits[num_digits - i - 1];
+  }
+  return num_digits;
+}
+
+// make room for length more bytes at the end of the exchange's output buffer
+static char* reserve_output(evweb_exchange* exchange, size_t length) {
+  char* output;
+  size_t used = 0;
+  size_t capacity;
+  int i;
+
+  // only the heads live in the buffer, bodies are separate parts
+  for (i = 0; i < exchange->num_parts; i += 1)
+  {
+    if ( (NULL == exchange->parts[i].data) && (-1 == exchange->parts[i].fd) )
+    {
+      used = exchange->parts[i].offset + exchange->parts[i].length;
+    }
+  }
+
+  if (used + length > exchange->output_capacity)
+  {
+    capacity = (0 == exchange->output_capacity) ? 1024 : exchange->output_capacity;
+    while (capacity < used + length)
+    {
+      capacity *= 2;
+    }
+    output = realloc(exchange->output, capacity);
+    if (NULL == output)
+    {
+      print_err("failed to allocate memory for the response output: %s\n", strerror(errno));
+      return NULL;
+    }
+    exchange->output = output;
+    exchange->output_capacity = capacity;
+  }
+
+  return exchange->output + used;
+}
+
+static evweb_output_part* next_output_part(evweb_exchange* exchange) {
+  evweb_output_part* parts;
+  int max_parts;
+
+  if (exchange->num_parts == exchange->max_parts)
+  {
+    max_parts = (0 == exchange->max_parts) ? 4 : exchange->max_parts * 2;
+    parts = realloc(exchange->parts, max_parts * sizeof (evweb_output_part));
+    if (NULL == parts)
+    {
+      print_err("failed to allocate memory for the response parts: %s\n", strerror(errno));
+      return NULL;
+    }
+    exchange->parts = parts;
+    exchange->max_parts = max_parts;
+  }
+
+  parts = exchange->parts + exchange->num_parts;
+  exchange->num_parts += 1;
+  memset(parts, 0, sizeof (evweb_output_part));
+  parts->fd = -1;
+  return parts;
+}
+
+static struct iovec* reserve_iov(evweb_http_processer* processer, int count) {
+  struct iovec* iov;
+
+  if (count > processer->max_iov)
+  {
+    iov = realloc(processer->iov, count * sizeof (struct iovec));
+    if (NULL == iov)
+    {
+      print_err("failed to allocate memory to gather responses: %s\n", strerror(errno));
+      return NULL;
+    }
+    processer->iov = iov;
+    processer->max_iov = count;
+  }
+
+  return processer->iov;
+}
+
+// Hand the parts to the socket with writev, as much of them as it will take right now. Returns
+// how many bytes went out, or -1 if the connection failed and has been destroyed.
+static ssize_t write_iov(struct evn_stream* stream, struct iovec* iov, int count) {
+  ssize_t written;
+  ssize_t total = 0;
+  size_t length;
+  int end;
+  int i = 0;
+  int j;
+
+  while (i < count)
+  {
+    end = (count - i > IOV_MAX) ? i + IOV_MAX : count;
+    written = writev(stream->fd, iov + i, end - i);
+    if (-1 == written)
+    {
+      if (EINTR == errno)
+      {
+        continue;
+      }
+      if ( (EAGAIN != errno) && (EWOULDBLOCK != errno) )
+      {
+        print_err("failed to write to connection: %s\n", strerror(errno));
+        evn_stream_destroy(stream->EV_A, stream);
+        return -1;
+      }
+      break;
+    }
+    total += written;
+
+    length = 0;
+    for (j = i; j < end; j += 1)
+    {
+      length += iov[j].iov_len;
+    }
+    if ((size_t)written < length)
+    {
+      // a short write means the socket buffer is full
+      break;
+    }
+    i = end;
+  }
+
+  return total;
+}
+
+// Account for written bytes of the parts that were just gathered, in the order they were
+// gathered. Parts that went out completely are handed back, one that only partly did keeps
+// its place with the rest still to send. Returns false if the socket didn't take them all.
+static bool consume_output(evweb_http_processer* processer, size_t written) {
+  evweb_exchange* exchange;
+  evweb_output_part* part;
+
+  for (exchange = processer->exchanges; NULL != exchange; exchange = exchange->next)
+  {
+    while (exchange->sent_parts < exchange->num_parts)
+    {
+      part = exchange->parts + exchange->sent_parts;
+      if (-1 != part->fd)
+      {
+        // everything ahead of the file is out, it's sent on its own
+        return true;
+      }
+      if (written < part->length)
+      {
+        part->offset += written;
+        part->length -= written;
+        return false;
+      }
+      written -= part->length;
+      part->length = 0;
+      release_sent_parts(processer->worker, exchange, exchange->sent_parts + 1);
+    }
+    if ( (false == exchange->ended) || (false == exchange->keep_alive) )
+    {
+      break;
+    }
+  }
+
+  return true;
+}
+
+// Send as much of a file as the socket will take. When it fills up we wait for it to become
+// writable again rather than reading anything into memory, so a file costs us nothing but its fd.
+static bool send_file_part(evweb_http_processer* processer, struct evn_stream* stream, evweb_output_part* part) {
+  ssize_t sent;
+
+  while (part->length > 0)
+  {
+    sent = sendfile(stream->fd, part->fd, &(part->file_offset), part->length);
+    if (-1 == sent)
+    {
+      if (EINTR == errno)
+      {
+        continue;
+      }
+      if ( (EAGAIN == errno) || (EWOULDBLOCK == errno) )
+      {
+        wait_for_writable(processer, stream);
+        return false;
+      }
+      print_err("failed to send file to connection: %s\n", strerror(errno));
+      evn_stream_destroy(stream->EV_A, stream);
+      return false;
+    }
+    if (0 == sent)
+    {
+      // the file shrank since we sent its length, there's no way to frame the rest correctly
+      print_err("file ended %zu bytes short of what we promised, dropping connection\n", part->length);
+      evn_stream_destroy(stream->EV_A, stream);
+      return false;
+    }
+    part->length -= sent;
+  }
+
+  return true;
+}
+
+static void wait_for_writable(evweb_http_processer* processer, struct evn_stream* stream) {
+  if (ev_is_active(&(processer->write_watcher)))
+  {
+    return;
+  }
+
+  print_debug("socket is full, waiting for it to drain before sending more\n");
+  processer->write_pending = true;
+  ev_io_init(&(processer->write_watcher), on_writable, stream->fd, EV_WRITE);
+  processer->write_watcher.data = stream;
+  ev_io_start(stream->EV_A, &(processer->write_watcher));
+
+  // a long download is still activity, don't let the idle timeout cut it off
+  evn_stream_set_timeout(stream->EV_A, stream, processer->worker->server->settings->max_keep_alive * 1000);
+}
+
+static void on_writable(EV_P, ev_io* watcher, int revents) {
+  struct evn_stream* stream = (struct evn_stream*)watcher->data;
+  evweb_http_processer* processer = (evweb_http_processer*)stream->send_data;
+
+  ev_io_stop(EV_A, watcher);
+  processer->write_pending = false;
+  if ( (true == processer->close_on_drain) && (NULL == processer->exchanges) )
+  {
+    print_debug("all data sent, we can now close connection\n");
+    evn_stream_end(EV_A, stream);
+    return;
+  }
+
+  // carry on from wherever the socket filled up
+  flush_exchanges(processer);
+}
+
+// hand back everything the exchange has queued up to part count, it's all been written
+static void release_sent_parts(evweb_worker* worker, evweb_exchange* exchange, int count) {
+  evweb_output_part* part;
+
+  for (; exchange->sent_parts < count; exchange->sent_parts += 1)
+  {
+    part = exchange->parts + exchange->sent_parts;
+    // bodies are only ever written from where they are, nothing may be let go of with bytes
+    // still to send because nothing else has a copy of them
+    assert(0 == part->length);
+    release_part(worker, part);
+  }
+}
+
+static void release_part(evweb_worker* worker, evweb_output_part* part) {
+  if (NULL != part->segment)
+  {
+    release_segment(worker, part->segment);
+  }
+  if (NULL != part->release)
+  {
+    part->release(part->release_ctx, part->data);
+  }
+  if (-1 != part->fd)
+  {
+    close(part->fd);
+  }
+}
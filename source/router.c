@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "router.h"
+
+#ifndef DEBUG_ROUTER
+  #ifdef DEBUG
+    #define DEBUG_ROUTER 1
+  #else
+    #define DEBUG_ROUTER 0
+  #endif
+#endif
+
+#if DEBUG_ROUTER
+  #define print_debug(...) printf("[router] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[router] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[router] " __VA_ARGS__)
+
+static evweb_route_node* add_segment(evweb_route_node* node, char* resource, char* segment, size_t length, bool last, int* num_params);
+static evweb_route_node* match(evweb_route_node* node, enum http_method method, char* path, char* start, char* end,
+                               evweb_route_param* params, int* num_params);
+static int compare_segment(evweb_route_node* node, const char* segment, size_t length);
+static int find_child(evweb_route_node* node, const char* segment, size_t length, bool* found);
+static evweb_route_node* create_node(const char* segment, size_t length);
+static evweb_route_node* add_child(evweb_route_node* node, const char* segment, size_t length);
+static void free_node(evweb_route_node* node);
+
+// Routes are compiled into a trie with one level per path segment as they're added, so finding
+// the callbacks for a request costs the length of its path no matter how many routes there are.
+// Routes can capture segments with ":name" and the rest of the path with a final "*name".
+evweb_router* router_create(void) {
+  evweb_router* router;
+
+  router = calloc(1, sizeof (evweb_router));
+  if (NULL == router)
+  {
+    print_err("failed to allocate memory for the router: %s\n", strerror(errno));
+    return NULL;
+  }
+  return router;
+}
+
+void router_destroy(evweb_router* router) {
+  free_node(&(router->root));
+  free(router);
+}
+
+int router_add(evweb_router* router, enum http_method method, char* resource, int position) {
+  evweb_route_node* node = &(router->root);
+  evweb_route_targets* targets;
+  int* positions;
+  char* start = resource;
+  char* end;
+  int num_params = 0;
+
+  if ( ((int)method < 0) || ((int)method >= EVWEB_NUM_METHODS) )
+  {
+    print_err("can't route HTTP method %d\n", method);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // splitting on every slash keeps the match exact, "/a/b", "/a/b/" and "/a//b" all differ
+  while (true)
+  {
+    end = strchr(start, '/');
+    if (NULL == end)
+    {
+      end = start + strlen(start);
+    }
+
+    node = add_segment(node, resource, start, end - start, ('\0' == *end), &num_params);
+    if (NULL == node)
+    {
+      return -1;
+    }
+
+    if ('\0' == *end)
+    {
+      break;
+    }
+    start = end + 1;
+  }
+
+  targets = node->methods + method;
+  if (targets->count >= targets->max_count)
+  {
+    positions = realloc(targets->positions, (targets->max_count + 1) * 2 * sizeof (int));
+    if (NULL == positions)
+    {
+      print_err("failed to allocate memory for the route %s: %s\n", resource, strerror(errno));
+      return -1;
+    }
+    targets->positions = positions;
+    targets->max_count = (targets->max_count + 1) * 2;
+  }
+  targets->positions[targets->count] = position;
+  targets->count += 1;
+  router->num_routes += 1;
+
+  print_debug("routing %s %s to callback %d\n", http_method_str(method), resource, position);
+  return 0;
+}
+
+int* router_lookup(evweb_router* router, enum http_method method, char* path, size_t path_length,
+                   evweb_route_param* params, int* num_params, int* count) {
+  evweb_route_node* node;
+
+  *count = 0;
+  *num_params = 0;
+  if ( (0 == router->num_routes) || ((int)method < 0) || ((int)method >= EVWEB_NUM_METHODS) )
+  {
+    return NULL;
+  }
+
+  node = match(&(router->root), method, path, path, path + path_length, params, num_params);
+  if (NULL == node)
+  {
+    return NULL;
+  }
+  *count = node->methods[method].count;
+  return node->methods[method].positions;
+}
+
+// find or make the node for the next segment of a route being added
+static evweb_route_node* add_segment(evweb_route_node* node, char* resource, char* segment, size_t length, bool last, int* num_params) {
+  evweb_route_node** slot;
+  bool found;
+  int i;
+
+  if ( (length < 1) || ( (':' != segment[0]) && ('*' != segment[0]) ) )
+  {
+    i = find_child(node, segment, length, &found);
+    return (true == found) ? node->children[i] : add_child(node, segment, length);
+  }
+
+  if ( ('*' == segment[0]) && (false == last) )
+  {
+    print_err("the wildcard in %s has to be its last segment\n", resource);
+    errno = EINVAL;
+    return NULL;
+  }
+  *num_params += 1;
+  if (*num_params > EVWEB_MAX_ROUTE_PARAMS)
+  {
+    print_err("%s captures more than %d parameters\n", resource, EVWEB_MAX_ROUTE_PARAMS);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // every route through here shares the one capture, so they have to agree on its name
+  slot = (':' == segment[0]) ? &(node->param) : &(node->wildcard);
+  if (NULL != *slot)
+  {
+    if (0 != compare_segment(*slot, segment + 1, length - 1))
+    {
+      print_err("%.*s in %s conflicts with %c%s from an earlier route\n", (int)length, segment, resource, segment[0], (*slot)->segment);
+      errno = EINVAL;
+      return NULL;
+    }
+    return *slot;
+  }
+  *slot = create_node(segment + 1, length - 1);
+  return *slot;
+}
+
+// Walk the trie a segment at a time, preferring an exact segment over a parameter over a
+// wildcard. When a branch runs out before finding a route for method we back up and try the
+// next best one, dropping anything that branch captured.
+static evweb_route_node* match(evweb_route_node* node, enum http_method method, char* path, char* start, char* end,
+                               evweb_route_param* params, int* num_params) {
+  evweb_route_node* result;
+  char* slash;
+  char* segment_end;
+  char* next;
+  bool found;
+  int i;
+
+  if (NULL == start)
+  {
+    return (0 == node->methods[method].count) ? NULL : node;
+  }
+
+  slash = memchr(start, '/', end - start);
+  segment_end = (NULL == slash) ? end : slash;
+  next = (NULL == slash) ? NULL : slash + 1;
+
+  i = find_child(node, start, segment_end - start, &found);
+  if (true == found)
+  {
+    result = match(node->children[i], method, path, next, end, params, num_params);
+    if (NULL != result)
+    {
+      return result;
+    }
+  }
+
+  if ( (NULL != node->param) && (segment_end > start) )
+  {
+    params[*num_params].name = node->param->segment;
+    params[*num_params].offset = start - path;
+    params[*num_params].length = segment_end - start;
+    *num_params += 1;
+    result = match(node->param, method, path, next, end, params, num_params);
+    if (NULL != result)
+    {
+      return result;
+    }
+    *num_params -= 1;
+  }
+
+  if ( (NULL != node->wildcard) && (0 != node->wildcard->methods[method].count) )
+  {
+    params[*num_params].name = node->wildcard->segment;
+    params[*num_params].offset = start - path;
+    params[*num_params].length = end - start;
+    *num_params += 1;
+    return node->wildcard;
+  }
+
+  return NULL;
+}
+
+static int compare_segment(evweb_route_node* node, const char* segment, size_t length) {
+  size_t shorter = (node->segment_length < length) ? node->segment_length : length;
+  int diff;
+
+  diff = memcmp(node->segment, segment, shorter);
+  if (0 != diff)
+  {
+    return diff;
+  }
+  return (node->segment_length > length) - (node->segment_length < length);
+}
+
+// where the child for segment is, or where it belongs if there isn't one
+static int find_child(evweb_route_node* node, const char* segment, size_t length, bool* found) {
+  int low = 0;
+  int high = node->num_children;
+  int middle;
+  int diff;
+
+  while (low < high)
+  {
+    middle = (low + high) / 2;
+    diff = compare_segment(node->children[middle], segment, length);
+    if (0 == diff)
+    {
+      *found = true;
+      return middle;
+    }
+    if (diff < 0)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  *found = false;
+  return low;
+}
+
+static evweb_route_node* create_node(const char* segment, size_t length) {
+  evweb_route_node* node;
+
+  node = calloc(1, sizeof (evweb_route_node));
+  if (NULL == node)
+  {
+    print_err("failed to allocate memory for a route node: %s\n", strerror(errno));
+    return NULL;
+  }
+  node->segment = malloc(length + 1);
+  if (NULL == node->segment)
+  {
+    print_err("failed to allocate memory for a route segment: %s\n", strerror(errno));
+    free(node);
+    return NULL;
+  }
+  memcpy(node->segment, segment, length);
+  node->segment[length] = '\0';
+  node->segment_length = length;
+  return node;
+}
+
+static evweb_route_node* add_child(evweb_route_node* node, const char* segment, size_t length) {
+  evweb_route_node* child;
+  evweb_route_node** children;
+  bool found;
+  int i;
+
+  if (node->num_children >= node->max_children)
+  {
+    children = realloc(node->children, (node->max_children + 2) * 2 * sizeof (evweb_route_node*));
+    if (NULL == children)
+    {
+      print_err("failed to allocate memory for route children: %s\n", strerror(errno));
+      return NULL;
+    }
+    node->children = children;
+    node->max_children = (node->max_children + 2) * 2;
+  }
+
+  child = create_node(segment, length);
+  if (NULL == child)
+  {
+    return NULL;
+  }
+
+  i = find_child(node, segment, length, &found);
+  memmove(node->children + i + 1, node->children + i, (node->num_children - i) * sizeof (evweb_route_node*));
+  node->children[i] = child;
+  node->num_children += 1;
+  return child;
+}
+
+// frees everything below node and what it holds, but not node itself
+static void free_node(evweb_route_node* node) {
+  int i;
+
+  for (i = 0; i < node->num_children; i += 1)
+  {
+    free_node(node->children[i]);
+    free(node->children[i]);
+  }
+  free(node->children);
+  if (NULL != node->param)
+  {
+    free_node(node->param);
+    free(node->param);
+  }
+  if (NULL != node->wildcard)
+  {
+    free_node(node->wildcard);
+    free(node->wildcard);
+  }
+  for (i = 0; i < EVWEB_NUM_METHODS; i += 1)
+  {
+    free(node->methods[i].positions);
+  }
+  free(node->segment);
+}
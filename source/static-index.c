@@ -0,0 +1,1116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+
+#include "response-writer.h"
+#include "static-index.h"
+
+#ifndef DEBUG_STATIC_INDEX
+  #ifdef DEBUG
+    #define DEBUG_STATIC_INDEX 1
+  #else
+    #define DEBUG_STATIC_INDEX 0
+  #endif
+#endif
+
+#if DEBUG_STATIC_INDEX
+  #define print_debug(...) printf("[static-index] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[static-index] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[static-index] " __VA_ARGS__)
+
+// IN_MODIFY is the only word we get of a file truncated or appended to by a writer that keeps
+// it open. A burst of them costs a single rebuild, since on_inotify batches what it reads
+#define STATIC_INDEX_WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                                 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// decides what a table rebuild does with each entry: keep it (return it), leave it out (NULL)
+// or put a new entry in its place
+typedef evweb_static_entry* (static_entry_transform)(evweb_static_entry* entry, void* arg);
+
+typedef struct {
+  evweb_static_entry** entries;
+  int num_entries;
+  int max_entries;
+} static_entry_list;
+
+typedef struct {
+  char* path;
+  size_t path_length;
+} static_path_match;
+
+// the paths inotify said changed, gathered so one rebuild covers all of them. None of them is
+// under another, and rescan stands in for all of them when everything has to be looked at again
+typedef struct {
+  static_path_match* paths;
+  int num_paths;
+  int max_paths;
+  bool rescan;
+} static_path_list;
+
+typedef struct {
+  evweb_static_entry* filled;
+  unsigned long cutoff;
+} static_fill;
+
+static unsigned int hash_path(char* path, size_t path_length);
+static evweb_static_entry* create_entry(evweb_static_index* index, char* path, size_t path_length, struct stat* sb);
+static evweb_static_entry* copy_entry(evweb_static_entry* entry);
+static void unref_entry(evweb_static_entry* entry);
+static int append_entry(static_entry_list* list, evweb_static_entry* entry);
+static void scan_tree(evweb_static_index* index, char* path, size_t path_length, static_entry_list* list);
+static void add_changed_path(static_path_list* changed, char* path, size_t path_length);
+static void update_paths(evweb_static_index* index, static_path_list* changed);
+static evweb_static_table* create_table(int num_entries);
+static void table_put(evweb_static_table* table, evweb_static_entry* entry);
+static evweb_static_entry* table_find(evweb_static_table* table, char* path, size_t path_length, unsigned int hash);
+static evweb_static_table* rebuild_table(evweb_static_table* old, int extra, static_entry_transform* transform, void* arg);
+static void publish_table(evweb_static_index* index, evweb_static_table* table);
+static void reclaim_tables(evweb_static_index* index);
+static void release_table(evweb_static_table* table);
+static bool path_under(char* path, size_t path_length, static_path_match* match);
+static bool path_matches(evweb_static_entry* entry, static_path_match* match);
+static evweb_static_entry* drop_matching(evweb_static_entry* entry, void* arg);
+static evweb_static_entry* make_room(evweb_static_entry* entry, void* arg);
+static int compare_last_used(const void* a, const void* b);
+static bool watch_directory(evweb_static_index* index, char* path, size_t path_length);
+static void on_inotify(EV_P, ev_io* watcher, int revents);
+static void on_reclaim(EV_P, ev_timer* watcher, int revents);
+
+evweb_static_index* static_index_create(char* directory, size_t cache_size, bool map_files, evweb_static_type_cb* guess_type) {
+  evweb_static_index* index;
+
+  index = calloc(1, sizeof (evweb_static_index));
+  if (NULL == index)
+  {
+    print_err("failed to allocate memory for the static index: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  index->directory = strdup(directory);
+  index->table = create_table(0);
+  if ( (NULL == index->directory) || (NULL == index->table) )
+  {
+    print_err("failed to allocate memory for the static index: %s\n", strerror(errno));
+    free(index->directory);
+    free(index->table);
+    free(index);
+    return NULL;
+  }
+  index->cache_size = cache_size;
+  index->map_files = map_files;
+  index->guess_type = guess_type;
+  index->epoch = 1;
+  index->inotify_fd = -1;
+  pthread_mutex_init(&(index->lock), NULL);
+
+  return index;
+}
+
+// Scan the whole root into the index and start watching it for changes on the loop given. The
+// watches go in as the directories are scanned, so nothing that changes during the scan is missed.
+int static_index_start(EV_P, evweb_static_index* index, int num_readers) {
+  static_entry_list list = { NULL, 0, 0 };
+  evweb_static_table* table;
+  int i;
+
+  index->reader_epochs = calloc(num_readers, sizeof (unsigned long));
+  if (NULL == index->reader_epochs)
+  {
+    print_err("failed to allocate memory for the static index readers: %s\n", strerror(errno));
+    return errno;
+  }
+  index->num_readers = num_readers;
+  index->EV_A = EV_A;
+
+  index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (-1 == index->inotify_fd)
+  {
+    // without inotify the index can't follow changes, so at least don't pin stale copies in memory
+    print_err("failed to start watching %s, changes won't be noticed: %s\n", index->directory, strerror(errno));
+    index->cache_size = 0;
+  }
+
+  pthread_mutex_lock(&(index->lock));
+  scan_tree(index, "", 0, &list);
+  table = create_table(list.num_entries);
+  if (NULL == table)
+  {
+    pthread_mutex_unlock(&(index->lock));
+    for (i = 0; i < list.num_entries; i += 1)
+    {
+      unref_entry(list.entries[i]);
+    }
+    free(list.entries);
+    return errno;
+  }
+  for (i = 0; i < list.num_entries; i += 1)
+  {
+    table_put(table, list.entries[i]);
+  }
+  free(list.entries);
+  publish_table(index, table);
+  pthread_mutex_unlock(&(index->lock));
+  print_status("indexed %d files under %s\n", table->num_entries, index->directory);
+
+  if (-1 != index->inotify_fd)
+  {
+    ev_io_init(&(index->inotify_watcher), on_inotify, index->inotify_fd, EV_READ);
+    index->inotify_watcher.data = index;
+    ev_io_start(EV_A, &(index->inotify_watcher));
+    // the index alone shouldn't keep the loop running
+    ev_unref(EV_A);
+  }
+
+  ev_timer_init(&(index->reclaim_timer), on_reclaim, 1., 1.);
+  index->reclaim_timer.data = index;
+  ev_timer_start(EV_A, &(index->reclaim_timer));
+  ev_unref(EV_A);
+
+  return 0;
+}
+
+void static_index_destroy(evweb_static_index* index) {
+  evweb_static_table* table;
+  int i;
+
+  if (NULL != index->EV_A)
+  {
+    if (-1 != index->inotify_fd)
+    {
+      ev_ref(index->EV_A);
+      ev_io_stop(index->EV_A, &(index->inotify_watcher));
+    }
+    ev_ref(index->EV_A);
+    ev_timer_stop(index->EV_A, &(index->reclaim_timer));
+  }
+  if (-1 != index->inotify_fd)
+  {
+    close(index->inotify_fd);
+  }
+
+  // by now no worker is reading, so everything can go
+  release_table(index->table);
+  while (NULL != index->retired)
+  {
+    table = index->retired;
+    index->retired = table->next_retired;
+    release_table(table);
+  }
+
+  for (i = 0; i < index->num_watches; i += 1)
+  {
+    free(index->watches[i].path);
+  }
+  free(index->watches);
+  free(index->reader_epochs);
+  free(index->directory);
+  pthread_mutex_destroy(&(index->lock));
+  free(index);
+}
+
+// Find a file without taking any lock or making any syscall, a miss included. The reader
+// announces the epoch it's reading in before it looks at the table, which keeps the table from
+// being freed out from under it, and the entry it finds is referenced before it stops reading.
+evweb_static_entry* static_index_lookup(evweb_static_index* index, int reader, unsigned long now, char* path, size_t path_length) {
+  unsigned long* reader_epoch;
+  evweb_static_table* table;
+  evweb_static_entry* entry;
+
+  if (reader >= index->num_readers)
+  {
+    return NULL;
+  }
+  reader_epoch = index->reader_epochs + reader;
+
+  __atomic_store_n(reader_epoch, __atomic_load_n(&(index->epoch), __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  table = __atomic_load_n(&(index->table), __ATOMIC_SEQ_CST);
+
+  entry = table_find(table, path, path_length, hash_path(path, path_length));
+  if (NULL != entry)
+  {
+    __atomic_add_fetch(&(entry->refs), 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&(entry->last_used), now, __ATOMIC_RELAXED);
+  }
+
+  __atomic_store_n(reader_epoch, 0, __ATOMIC_RELEASE);
+  return entry;
+}
+
+// Try to get the file's contents into memory, evicting the least recently used bodies to make
+// room. Takes over the caller's reference to entry and returns a referenced entry to serve,
+// which has a body if the file could be cached. Anything that changed while the file was being
+// read is served but not kept.
+evweb_static_entry* static_index_cache(evweb_static_index* index, evweb_static_entry* entry, unsigned long now) {
+  char full_path[PATH_MAX];
+  evweb_static_entry* filled;
+  evweb_static_entry** entries;
+  evweb_static_table* table;
+  static_fill fill;
+  unsigned long generation;
+  size_t cached_bytes;
+  struct stat sb;
+  char* body;
+  size_t total = 0;
+  ssize_t count;
+  int num_entries;
+  size_t i;
+  int j;
+  int fd;
+
+  if ( (NULL != entry->body) || (entry->size > EVWEB_STATIC_CACHE_MAX_FILE) || (entry->size > index->cache_size) )
+  {
+    return entry;
+  }
+
+  pthread_mutex_lock(&(index->lock));
+  generation = index->generation;
+  pthread_mutex_unlock(&(index->lock));
+
+  static_index_full_path(index, entry, full_path, sizeof full_path);
+  fd = open(full_path, O_RDONLY | O_CLOEXEC);
+  if (-1 == fd)
+  {
+    return entry;
+  }
+  body = malloc((0 == entry->size) ? 1 : entry->size);
+  if ( (NULL == body) || (-1 == fstat(fd, &sb)) || ((size_t)sb.st_size != entry->size) )
+  {
+    free(body);
+    close(fd);
+    return entry;
+  }
+  while (total < entry->size)
+  {
+    count = pread(fd, body + total, entry->size - total, total);
+    if ( (-1 == count) && (EINTR == errno) )
+    {
+      continue;
+    }
+    if (count <= 0)
+    {
+      break;
+    }
+    total += count;
+  }
+  close(fd);
+  if (total != entry->size)
+  {
+    free(body);
+    return entry;
+  }
+
+  filled = copy_entry(entry);
+  if (NULL == filled)
+  {
+    free(body);
+    return entry;
+  }
+  filled->body = body;
+  filled->last_used = now;
+
+  pthread_mutex_lock(&(index->lock));
+  table = index->table;
+  if ( (generation != index->generation) || (entry != table_find(table, entry->path, entry->path_length, entry->hash)) )
+  {
+    // the file changed since we started reading, serve what we read but don't keep it
+    print_debug("%s changed while it was being read, not caching it\n", entry->path);
+    pthread_mutex_unlock(&(index->lock));
+    unref_entry(entry);
+    return filled;
+  }
+
+  // everything used at or after the cutoff keeps its body
+  fill.filled = filled;
+  fill.cutoff = 0;
+  cached_bytes = table->cached_bytes + filled->size;
+  if (cached_bytes > index->cache_size)
+  {
+    entries = malloc(table->num_entries * sizeof (evweb_static_entry*));
+    if (NULL == entries)
+    {
+      pthread_mutex_unlock(&(index->lock));
+      unref_entry(entry);
+      return filled;
+    }
+    num_entries = 0;
+    for (i = 0; i < table->num_buckets; i += 1)
+    {
+      if ( (NULL != table->buckets[i]) && (NULL != table->buckets[i]->body) )
+      {
+        entries[num_entries] = table->buckets[i];
+        num_entries += 1;
+      }
+    }
+    qsort(entries, num_entries, sizeof (evweb_static_entry*), compare_last_used);
+
+    for (j = 0; (j < num_entries) && (cached_bytes > index->cache_size); j += 1)
+    {
+      cached_bytes -= entries[j]->size;
+    }
+    fill.cutoff = (j < num_entries) ? entries[j]->last_used : ULONG_MAX;
+    free(entries);
+  }
+
+  table = rebuild_table(index->table, 0, make_room, &fill);
+  if (NULL != table)
+  {
+    // one reference for the table, the one we started with goes to the caller
+    __atomic_add_fetch(&(filled->refs), 1, __ATOMIC_RELAXED);
+    table_put(table, filled);
+    publish_table(index, table);
+    print_debug("cached %s (%zu bytes, %zu cached)\n", filled->path, filled->size, table->cached_bytes);
+  }
+  pthread_mutex_unlock(&(index->lock));
+
+  unref_entry(entry);
+  return filled;
+}
+
+// Map the file into memory for every response to share, if this index maps files and the file
+// is a size worth mapping. Takes over the caller's reference to entry and returns a referenced
+// entry to serve, which has a map if it worked.
+//
+// A mapped file that's truncated while a response is still sending it would fault the writer,
+// so the file is only mapped while it's the size the index says, and a new entry without the
+// map takes over as soon as inotify reports the file was written to (IN_MODIFY, which includes
+// truncation), closed after writing, replaced or had its attributes changed. Only responses
+// already in flight can still see the old mapping.
+evweb_static_entry* static_index_map(evweb_static_index* index, evweb_static_entry* entry) {
+  char full_path[PATH_MAX];
+  evweb_static_entry* mapped;
+  evweb_static_table* table;
+  static_path_match match;
+  unsigned long generation;
+  struct stat sb;
+  char* map;
+  int fd;
+
+  if ( (false == index->map_files) || (NULL != entry->map) || (NULL != entry->body) ||
+       (entry->size < EVWEB_STATIC_MAP_MIN_FILE) || (entry->size > EVWEB_STATIC_MAP_MAX_FILE) )
+  {
+    return entry;
+  }
+
+  pthread_mutex_lock(&(index->lock));
+  generation = index->generation;
+  pthread_mutex_unlock(&(index->lock));
+
+  static_index_full_path(index, entry, full_path, sizeof full_path);
+  fd = open(full_path, O_RDONLY | O_CLOEXEC);
+  if (-1 == fd)
+  {
+    return entry;
+  }
+  if ( (-1 == fstat(fd, &sb)) || ((size_t)sb.st_size != entry->size) )
+  {
+    close(fd);
+    return entry;
+  }
+  map = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map)
+  {
+    print_err("failed to map %s: %s\n", full_path, strerror(errno));
+    return entry;
+  }
+  // responses read it front to back, and the first one should find it already paged in
+  madvise(map, entry->size, MADV_SEQUENTIAL);
+  madvise(map, entry->size, MADV_WILLNEED);
+
+  mapped = copy_entry(entry);
+  if (NULL == mapped)
+  {
+    munmap(map, entry->size);
+    return entry;
+  }
+  mapped->map = map;
+
+  pthread_mutex_lock(&(index->lock));
+  table = index->table;
+  if ( (generation != index->generation) || (entry != table_find(table, entry->path, entry->path_length, entry->hash)) )
+  {
+    // the file changed (or another worker got there first), this mapping serves just this response
+    pthread_mutex_unlock(&(index->lock));
+    unref_entry(entry);
+    return mapped;
+  }
+
+  match.path = entry->path;
+  match.path_length = entry->path_length;
+  table = rebuild_table(index->table, 1, drop_matching, &match);
+  if (NULL != table)
+  {
+    __atomic_add_fetch(&(mapped->refs), 1, __ATOMIC_RELAXED);
+    table_put(table, mapped);
+    publish_table(index, table);
+    print_debug("mapped %s (%zu bytes)\n", mapped->path, mapped->size);
+  }
+  pthread_mutex_unlock(&(index->lock));
+
+  unref_entry(entry);
+  return mapped;
+}
+
+void static_index_full_path(evweb_static_index* index, evweb_static_entry* entry, char* full_path, size_t size) {
+  snprintf(full_path, size, "%s%s", index->directory, entry->path);
+}
+
+// another hold on the entry, for each extra piece of its body lent to a response
+void static_index_retain(evweb_static_entry* entry) {
+  __atomic_add_fetch(&(entry->refs), 1, __ATOMIC_RELAXED);
+}
+
+// evweb_release_cb for responses serving a cached body
+void static_index_release(void* ctx, void* data) {
+  unref_entry((evweb_static_entry*)ctx);
+}
+
+static unsigned int hash_path(char* path, size_t path_length) {
+  unsigned int hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < path_length; i += 1)
+  {
+    hash ^= (unsigned char)path[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static evweb_static_entry* create_entry(evweb_static_index* index, char* path, size_t path_length, struct stat* sb) {
+  evweb_static_entry* entry;
+  char* extension = NULL;
+  size_t i;
+
+  entry = calloc(1, sizeof (evweb_static_entry));
+  if (NULL != entry)
+  {
+    entry->path = strndup(path, path_length);
+  }
+  if ( (NULL == entry) || (NULL == entry->path) )
+  {
+    print_err("failed to allocate memory to index %.*s: %s\n", (int)path_length, path, strerror(errno));
+    free(entry);
+    return NULL;
+  }
+  entry->path_length = path_length;
+  entry->hash = hash_path(path, path_length);
+  entry->size = (size_t)sb->st_size;
+  entry->mtime = sb->st_mtime;
+  entry->refs = 1;
+
+  // a strong validator has to change whenever the bytes might have, and a file replaced or
+  // rewritten gets a new inode or mtime even when its size stays the same
+  snprintf(entry->etag, sizeof entry->etag, "\"%lx-%zx-%lx.%lx\"", (unsigned long)sb->st_ino, entry->size,
+           (unsigned long)sb->st_mtim.tv_sec, (unsigned long)sb->st_mtim.tv_nsec);
+  format_http_date(entry->last_modified, sizeof entry->last_modified, entry->mtime);
+
+  for (i = path_length; (i > 0) && ('/' != path[i - 1]); i -= 1)
+  {
+    if ('.' == path[i - 1])
+    {
+      extension = entry->path + i;
+      break;
+    }
+  }
+  entry->type = index->guess_type( (NULL == extension) ? "octet-stream" : extension );
+
+  return entry;
+}
+
+// a new entry for the same file without its body
+static evweb_static_entry* copy_entry(evweb_static_entry* entry) {
+  evweb_static_entry* copy;
+
+  copy = malloc(sizeof (evweb_static_entry));
+  if (NULL == copy)
+  {
+    return NULL;
+  }
+  *copy = *entry;
+  copy->path = strdup(entry->path);
+  if (NULL == copy->path)
+  {
+    free(copy);
+    return NULL;
+  }
+  copy->body = NULL;
+  copy->map = NULL;
+  copy->refs = 1;
+  return copy;
+}
+
+static void unref_entry(evweb_static_entry* entry) {
+  if (0 == __atomic_sub_fetch(&(entry->refs), 1, __ATOMIC_ACQ_REL))
+  {
+    free(entry->body);
+    if (NULL != entry->map)
+    {
+      munmap(entry->map, entry->size);
+    }
+    free(entry->path);
+    free(entry);
+  }
+}
+
+static int append_entry(static_entry_list* list, evweb_static_entry* entry) {
+  evweb_static_entry** entries;
+  int max_entries;
+
+  if (list->num_entries == list->max_entries)
+  {
+    max_entries = (0 == list->max_entries) ? 64 : list->max_entries * 2;
+    entries = realloc(list->entries, max_entries * sizeof (evweb_static_entry*));
+    if (NULL == entries)
+    {
+      print_err("failed to allocate memory for the static index: %s\n", strerror(errno));
+      return errno;
+    }
+    list->entries = entries;
+    list->max_entries = max_entries;
+  }
+
+  list->entries[list->num_entries] = entry;
+  list->num_entries += 1;
+  return 0;
+}
+
+// Add every regular file under path to list, watching each directory on the way down. Symlinks
+// to files are followed, symlinks to directories aren't so a loop can't run away with us.
+// Must hold the lock.
+static void scan_tree(evweb_static_index* index, char* path, size_t path_length, static_entry_list* list) {
+  char full_path[PATH_MAX];
+  char child[PATH_MAX];
+  size_t child_length;
+  struct dirent* dirent;
+  struct stat sb;
+  evweb_static_entry* entry;
+  DIR* dir;
+
+  if (-1 != index->inotify_fd)
+  {
+    watch_directory(index, path, path_length);
+  }
+
+  snprintf(full_path, sizeof full_path, "%s%.*s", index->directory, (int)path_length, path);
+  dir = opendir(full_path);
+  if (NULL == dir)
+  {
+    print_err("failed to scan %s: %s\n", full_path, strerror(errno));
+    return;
+  }
+
+  while (NULL != (dirent = readdir(dir)))
+  {
+    if ( (0 == strcmp(".", dirent->d_name)) || (0 == strcmp("..", dirent->d_name)) )
+    {
+      continue;
+    }
+    child_length = snprintf(child, sizeof child, "%.*s/%s", (int)path_length, path, dirent->d_name);
+    snprintf(full_path, sizeof full_path, "%s%s", index->directory, child);
+    if ( (child_length >= sizeof child) || (-1 == lstat(full_path, &sb)) )
+    {
+      continue;
+    }
+
+    if (S_ISDIR(sb.st_mode))
+    {
+      scan_tree(index, child, child_length, list);
+      continue;
+    }
+    if ( (S_ISLNK(sb.st_mode)) && (-1 == stat(full_path, &sb)) )
+    {
+      continue;
+    }
+    if (!S_ISREG(sb.st_mode))
+    {
+      continue;
+    }
+
+    entry = create_entry(index, child, child_length, &sb);
+    if ( (NULL != entry) && (0 != append_entry(list, entry)) )
+    {
+      unref_entry(entry);
+    }
+  }
+  closedir(dir);
+}
+
+// remember that path changed, unless something already remembered covers it
+static void add_changed_path(static_path_list* changed, char* path, size_t path_length) {
+  static_path_match match = { path, path_length };
+  static_path_match* paths;
+  char* copy;
+  int max_paths;
+  int i;
+
+  if (true == changed->rescan)
+  {
+    return;
+  }
+  for (i = 0; i < changed->num_paths; i += 1)
+  {
+    if (true == path_under(path, path_length, changed->paths + i))
+    {
+      return;
+    }
+  }
+
+  // a directory that changed takes in anything under it we already had
+  i = 0;
+  while (i < changed->num_paths)
+  {
+    if (true == path_under(changed->paths[i].path, changed->paths[i].path_length, &match))
+    {
+      free(changed->paths[i].path);
+      changed->num_paths -= 1;
+      changed->paths[i] = changed->paths[changed->num_paths];
+      continue;
+    }
+    i += 1;
+  }
+
+  if (changed->num_paths == changed->max_paths)
+  {
+    max_paths = (0 == changed->max_paths) ? 8 : changed->max_paths * 2;
+    paths = realloc(changed->paths, max_paths * sizeof (static_path_match));
+    if (NULL != paths)
+    {
+      changed->paths = paths;
+      changed->max_paths = max_paths;
+    }
+  }
+  copy = strndup(path, path_length);
+  if ( (changed->num_paths == changed->max_paths) || (NULL == copy) )
+  {
+    // losing track of a change would leave it stale, so look at everything instead
+    print_err("failed to allocate memory to track a change, rescanning everything\n");
+    free(copy);
+    changed->rescan = true;
+    return;
+  }
+  changed->paths[changed->num_paths].path = copy;
+  changed->paths[changed->num_paths].path_length = path_length;
+  changed->num_paths += 1;
+}
+
+// Bring everything inotify told us changed up to date in one rebuild: drop what the index had
+// at each path and anything under it, then add back what's there now. Must hold the lock.
+static void update_paths(evweb_static_index* index, static_path_list* changed) {
+  char full_path[PATH_MAX];
+  static_entry_list list = { NULL, 0, 0 };
+  evweb_static_table* table;
+  evweb_static_entry* entry;
+  struct stat sb;
+  size_t i;
+  int j;
+  bool found = false;
+
+  if (true == changed->rescan)
+  {
+    for (j = 0; j < changed->num_paths; j += 1)
+    {
+      free(changed->paths[j].path);
+    }
+    changed->num_paths = 0;
+    changed->rescan = false;
+    add_changed_path(changed, "", 0);
+  }
+  if (0 == changed->num_paths)
+  {
+    return;
+  }
+
+  index->generation += 1;
+
+  for (j = 0; j < changed->num_paths; j += 1)
+  {
+    snprintf(full_path, sizeof full_path, "%s%s", index->directory, changed->paths[j].path);
+    if (-1 == lstat(full_path, &sb))
+    {
+      continue;
+    }
+    if (S_ISDIR(sb.st_mode))
+    {
+      scan_tree(index, changed->paths[j].path, changed->paths[j].path_length, &list);
+    }
+    else if ( ( (!S_ISLNK(sb.st_mode)) || (0 == stat(full_path, &sb)) ) && (S_ISREG(sb.st_mode)) )
+    {
+      entry = create_entry(index, changed->paths[j].path, changed->paths[j].path_length, &sb);
+      if ( (NULL != entry) && (0 != append_entry(&list, entry)) )
+      {
+        unref_entry(entry);
+      }
+    }
+  }
+
+  for (i = 0; (i < index->table->num_buckets) && (false == found); i += 1)
+  {
+    found = ( (NULL != index->table->buckets[i]) && (NULL == drop_matching(index->table->buckets[i], changed)) );
+  }
+  if ( (false == found) && (0 == list.num_entries) )
+  {
+    free(list.entries);
+    return;
+  }
+
+  print_debug("%d paths changed, %d files there now\n", changed->num_paths, list.num_entries);
+  table = rebuild_table(index->table, list.num_entries, drop_matching, changed);
+  if (NULL == table)
+  {
+    // better to have nothing indexed than to serve something stale
+    table = create_table(0);
+  }
+  for (j = 0; j < list.num_entries; j += 1)
+  {
+    if (NULL == table)
+    {
+      unref_entry(list.entries[j]);
+      continue;
+    }
+    table_put(table, list.entries[j]);
+  }
+  free(list.entries);
+  if (NULL != table)
+  {
+    publish_table(index, table);
+  }
+}
+
+static evweb_static_table* create_table(int num_entries) {
+  evweb_static_table* table;
+
+  table = calloc(1, sizeof (evweb_static_table));
+  if (NULL == table)
+  {
+    return NULL;
+  }
+
+  // keep the table at most half full so probes stay short
+  table->num_buckets = 16;
+  while (table->num_buckets < 2 * (size_t)num_entries)
+  {
+    table->num_buckets *= 2;
+  }
+  table->buckets = calloc(table->num_buckets, sizeof (evweb_static_entry*));
+  if (NULL == table->buckets)
+  {
+    free(table);
+    return NULL;
+  }
+  return table;
+}
+
+// add an entry the caller holds a reference for, which the table takes over
+static void table_put(evweb_static_table* table, evweb_static_entry* entry) {
+  size_t i = entry->hash & (table->num_buckets - 1);
+
+  while (NULL != table->buckets[i])
+  {
+    i = (i + 1) & (table->num_buckets - 1);
+  }
+  table->buckets[i] = entry;
+  table->num_entries += 1;
+  if (NULL != entry->body)
+  {
+    table->cached_bytes += entry->size;
+  }
+}
+
+static evweb_static_entry* table_find(evweb_static_table* table, char* path, size_t path_length, unsigned int hash) {
+  size_t i = hash & (table->num_buckets - 1);
+  evweb_static_entry* entry;
+
+  while (NULL != (entry = table->buckets[i]))
+  {
+    if ( (hash == entry->hash) && (path_length == entry->path_length) && (0 == memcmp(path, entry->path, path_length)) )
+    {
+      return entry;
+    }
+    i = (i + 1) & (table->num_buckets - 1);
+  }
+  return NULL;
+}
+
+// copy old into a new table with room for extra more entries, passing each through transform
+static evweb_static_table* rebuild_table(evweb_static_table* old, int extra, static_entry_transform* transform, void* arg) {
+  evweb_static_table* table;
+  evweb_static_entry* entry;
+  size_t i;
+
+  table = create_table(old->num_entries + extra);
+  if (NULL == table)
+  {
+    print_err("failed to allocate memory for the static index table: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  for (i = 0; i < old->num_buckets; i += 1)
+  {
+    if (NULL == old->buckets[i])
+    {
+      continue;
+    }
+    entry = transform(old->buckets[i], arg);
+    if (entry == old->buckets[i])
+    {
+      __atomic_add_fetch(&(entry->refs), 1, __ATOMIC_RELAXED);
+    }
+    if (NULL != entry)
+    {
+      table_put(table, entry);
+    }
+  }
+  return table;
+}
+
+// Swap in a new table. Readers that started before the swap might still be looking at the old
+// one, so it's retired with the epoch the swap started, and freed once every reader is idle or
+// reading in a later epoch. Must hold the lock.
+static void publish_table(evweb_static_index* index, evweb_static_table* table) {
+  evweb_static_table* old = index->table;
+
+  __atomic_store_n(&(index->table), table, __ATOMIC_SEQ_CST);
+  old->retired_epoch = __atomic_add_fetch(&(index->epoch), 1, __ATOMIC_SEQ_CST);
+  old->next_retired = index->retired;
+  index->retired = old;
+
+  reclaim_tables(index);
+}
+
+// free the retired tables no reader can still see. Must hold the lock
+static void reclaim_tables(evweb_static_index* index) {
+  evweb_static_table** link = &(index->retired);
+  evweb_static_table* table;
+  unsigned long reader_epoch;
+  bool in_use;
+  int i;
+
+  while (NULL != (table = *link))
+  {
+    in_use = false;
+    for (i = 0; (i < index->num_readers) && (false == in_use); i += 1)
+    {
+      reader_epoch = __atomic_load_n(index->reader_epochs + i, __ATOMIC_SEQ_CST);
+      in_use = ( (0 != reader_epoch) && (reader_epoch < table->retired_epoch) );
+    }
+
+    if (true == in_use)
+    {
+      link = &(table->next_retired);
+      continue;
+    }
+    *link = table->next_retired;
+    release_table(table);
+  }
+}
+
+static void release_table(evweb_static_table* table) {
+  size_t i;
+
+  for (i = 0; i < table->num_buckets; i += 1)
+  {
+    if (NULL != table->buckets[i])
+    {
+      unref_entry(table->buckets[i]);
+    }
+  }
+  free(table->buckets);
+  free(table);
+}
+
+// true for the matched path itself and, when it's a directory, everything under it
+static bool path_under(char* path, size_t path_length, static_path_match* match) {
+  if ( (path_length < match->path_length) || (0 != memcmp(path, match->path, match->path_length)) )
+  {
+    return false;
+  }
+  return ( (path_length == match->path_length) || ('/' == path[match->path_length]) );
+}
+
+static bool path_matches(evweb_static_entry* entry, static_path_match* match) {
+  return path_under(entry->path, entry->path_length, match);
+}
+
+// leaves out every entry at or under one of the changed paths
+static evweb_static_entry* drop_matching(evweb_static_entry* entry, void* arg) {
+  static_path_list* changed = (static_path_list*)arg;
+  int i;
+
+  for (i = 0; i < changed->num_paths; i += 1)
+  {
+    if (true == path_matches(entry, changed->paths + i))
+    {
+      return NULL;
+    }
+  }
+  return entry;
+}
+
+// the filled entry takes the old one's place, and bodies used before the cutoff are dropped
+static evweb_static_entry* make_room(evweb_static_entry* entry, void* arg) {
+  static_fill* fill = (static_fill*)arg;
+
+  if ( (entry->hash == fill->filled->hash) && (0 == strcmp(entry->path, fill->filled->path)) )
+  {
+    return NULL;
+  }
+  if ( (NULL != entry->body) && (entry->last_used < fill->cutoff) )
+  {
+    print_debug("evicting %s from the cache\n", entry->path);
+    return copy_entry(entry);
+  }
+  return entry;
+}
+
+static int compare_last_used(const void* a, const void* b) {
+  unsigned long a_used = (*(evweb_static_entry**)a)->last_used;
+  unsigned long b_used = (*(evweb_static_entry**)b)->last_used;
+
+  return (a_used < b_used) ? -1 : (a_used > b_used) ? 1 : 0;
+}
+
+// make sure inotify is telling us about the directory at path. Must hold the lock
+static bool watch_directory(evweb_static_index* index, char* path, size_t path_length) {
+  char full_path[PATH_MAX];
+  evweb_static_watch* watches;
+  char* watch_path;
+  int wd;
+  int i;
+
+  snprintf(full_path, sizeof full_path, "%s%.*s", index->directory, (int)path_length, path);
+  wd = inotify_add_watch(index->inotify_fd, full_path, STATIC_INDEX_WATCH_MASK);
+  if (-1 == wd)
+  {
+    print_err("failed to watch %s for changes: %s\n", full_path, strerror(errno));
+    return false;
+  }
+  watch_path = strndup(path, path_length);
+  if (NULL == watch_path)
+  {
+    return false;
+  }
+
+  // a directory that moved keeps its watch, it just goes by a new name
+  for (i = 0; i < index->num_watches; i += 1)
+  {
+    if (wd == index->watches[i].wd)
+    {
+      free(index->watches[i].path);
+      index->watches[i].path = watch_path;
+      return true;
+    }
+  }
+
+  if (index->num_watches == index->max_watches)
+  {
+    i = (0 == index->max_watches) ? 8 : index->max_watches * 2;
+    watches = realloc(index->watches, i * sizeof (evweb_static_watch));
+    if (NULL == watches)
+    {
+      print_err("failed to allocate memory to watch another directory: %s\n", strerror(errno));
+      free(watch_path);
+      return false;
+    }
+    index->watches = watches;
+    index->max_watches = i;
+  }
+
+  index->watches[index->num_watches].wd = wd;
+  index->watches[index->num_watches].path = watch_path;
+  index->num_watches += 1;
+  print_debug("watching %s for changes\n", full_path);
+  return true;
+}
+
+static void on_inotify(EV_P, ev_io* watcher, int revents) {
+  evweb_static_index* index = (evweb_static_index*)watcher->data;
+  char buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  char path[PATH_MAX];
+  static_path_list changed = { NULL, 0, 0, false };
+  struct inotify_event* event;
+  evweb_static_watch* watch;
+  ssize_t length;
+  char* cur_pos;
+  int i;
+
+  pthread_mutex_lock(&(index->lock));
+  while (0 < (length = read(index->inotify_fd, buffer, sizeof buffer)))
+  {
+    for (cur_pos = buffer; cur_pos < buffer + length; cur_pos += sizeof (struct inotify_event) + event->len)
+    {
+      event = (struct inotify_event*)cur_pos;
+
+      if (IN_Q_OVERFLOW & event->mask)
+      {
+        // we've missed something, so start over from the top
+        print_err("inotify queue overflowed, rescanning %s\n", index->directory);
+        changed.rescan = true;
+        continue;
+      }
+
+      watch = NULL;
+      for (i = 0; i < index->num_watches; i += 1)
+      {
+        if (event->wd == index->watches[i].wd)
+        {
+          watch = index->watches + i;
+          break;
+        }
+      }
+      if (NULL == watch)
+      {
+        continue;
+      }
+
+      if (IN_IGNORED & event->mask)
+      {
+        // the directory is gone, if it comes back its parent will tell us
+        free(watch->path);
+        index->num_watches -= 1;
+        *watch = index->watches[index->num_watches];
+        continue;
+      }
+      if ( (IN_DELETE_SELF | IN_MOVE_SELF) & event->mask )
+      {
+        add_changed_path(&changed, watch->path, strlen(watch->path));
+        continue;
+      }
+      if (0 < event->len)
+      {
+        snprintf(path, sizeof path, "%s/%s", watch->path, event->name);
+        add_changed_path(&changed, path, strlen(path));
+      }
+    }
+  }
+
+  // a burst of events, like a deploy copying in a whole tree, costs a single rebuild
+  update_paths(index, &changed);
+  for (i = 0; i < changed.num_paths; i += 1)
+  {
+    free(changed.paths[i].path);
+  }
+  free(changed.paths);
+  reclaim_tables(index);
+  pthread_mutex_unlock(&(index->lock));
+}
+
+// readers finishing don't tell anyone, so every so often we check if retired tables can go
+static void on_reclaim(EV_P, ev_timer* watcher, int revents) {
+  evweb_static_index* index = (evweb_static_index*)watcher->data;
+
+  pthread_mutex_lock(&(index->lock));
+  reclaim_tables(index);
+  pthread_mutex_unlock(&(index->lock));
+}
@@ -1,14 +1,25 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include <ev.h>
 #include <evn.h>
 
 #include "evweb.h"
+#include "body-segment.h"
+#include "compress-filter.h"
 #include "http-parser-callbacks.h"
+#include "processer-pool.h"
+#include "response-writer.h"
 #include "tcp-server.h"
+#include "read-buffer.h"
+#include "uring.h"
 
 #ifndef DEBUG_TCP_SERVER
   #ifdef DEBUG
@@ -26,54 +37,530 @@
 #define print_status(...) printf("[tcp-server] " __VA_ARGS__)
 #define print_err(...) fprintf(stderr, "[tcp-server] " __VA_ARGS__)
 
-//static http_parser_settings parser_settings;
-static evweb_server_settings* server_settings;
-static struct evn_server* server;
-
-static void on_server_error(EV_P, struct evn_server* server, struct evn_exception* error);
-static void on_server_close(EV_P, struct evn_server* server);
-static void on_connection(EV_P, struct evn_server* server, struct evn_stream* stream);
-
+static int  listen_reuseport(int port);
+static void start_worker(evweb_worker* worker);
+static void stop_worker_watchers(evweb_worker* worker);
+static void* run_worker(void* arg);
+static void on_accept(EV_P_ ev_io* watcher, int revents);
+static void on_handoff(EV_P_ ev_async* watcher, int revents);
+static void on_worker_stop(EV_P_ ev_async* watcher, int revents);
+static bool on_connection(EV_P, evweb_worker* worker, struct evn_stream* stream);
+
+static int  start_acceptor(evweb_server* server);
+static void* run_acceptor(void* arg);
+static void on_acceptor_accept(EV_P_ ev_io* watcher, int revents);
+static void on_acceptor_stop(EV_P_ ev_async* watcher, int revents);
+static bool handoff_fd(evweb_server* server, int fd);
+
+static void on_readable(EV_P_ ev_io* watcher, int revents);
 static void on_stream_data(EV_P, struct evn_stream* stream, void* data, int size);
 static void on_stream_end(EV_P, struct evn_stream* stream);
+static void give_back_input(void* data, evweb_release_cb* release, void* release_ctx);
 static void on_stream_timeout(EV_P, struct evn_stream* stream);
 static void on_stream_error(EV_P, struct evn_stream* stream, struct evn_exception* error);
 static void on_stream_close(EV_P, struct evn_stream* stream, bool had_error);
 
-void start_tcp_server(EV_P, int port, evweb_server_settings* settings) {
-  server_settings = settings;
-  server = evn_server_create(EV_A, on_connection);
+int start_tcp_server(EV_P, evweb_server* server) {
+  int i;
+  evweb_worker* worker;
+
+  server->num_workers = server->settings->workers;
+  if (server->num_workers < 1)
+  {
+    server->num_workers = 1;
+  }
+
+  server->workers = calloc(server->num_workers, sizeof (evweb_worker));
+  if (NULL == server->workers)
+  {
+    print_err("failed to allocate memory for %d workers: %s\n", server->num_workers, strerror(errno));
+    return -1;
+  }
 
-  server->on_error = on_server_error;
-  server->on_close = on_server_close;
-  evn_server_listen(server, port, "0.0.0.0");
+  for (i = 0; i < server->num_workers; i += 1)
+  {
+    worker = server->workers + i;
+    worker->server = server;
+    worker->index = i;
+    worker->listen_fd = -1;
+  }
+
+  // open every listener before starting any threads so a failed bind is reported to the caller
+  if (true == server->settings->acceptor_thread)
+  {
+    server->acceptor.listen_fd = listen_reuseport(server->port);
+    if (-1 == server->acceptor.listen_fd)
+    {
+      free(server->workers);
+      server->workers = NULL;
+      return -1;
+    }
+  }
+  else
+  {
+    for (i = 0; i < server->num_workers; i += 1)
+    {
+      worker = server->workers + i;
+      worker->listen_fd = listen_reuseport(server->port);
+      if (-1 == worker->listen_fd)
+      {
+        for (i -= 1; i >= 0; i -= 1)
+        {
+          close(server->workers[i].listen_fd);
+        }
+        free(server->workers);
+        server->workers = NULL;
+        return -1;
+      }
+    }
+  }
+
+  // the first worker shares the caller's loop, every other worker gets a loop and thread of its own
+  server->workers[0].EV_A = EV_A;
+  start_worker(server->workers);
+  for (i = 1; i < server->num_workers; i += 1)
+  {
+    worker = server->workers + i;
+    worker->EV_A = ev_loop_new(EVFLAG_AUTO);
+    if (NULL == worker->EV_A)
+    {
+      print_err("failed to create loop for worker %d, it will not accept connections\n", i);
+      if (-1 != worker->listen_fd)
+      {
+        close(worker->listen_fd);
+        worker->listen_fd = -1;
+      }
+      continue;
+    }
+    start_worker(worker);
+
+    if (0 != pthread_create(&(worker->thread), NULL, run_worker, worker))
+    {
+      print_err("failed to start thread for worker %d, it will not accept connections\n", i);
+      stop_worker_watchers(worker);
+      ev_loop_destroy(worker->EV_A);
+      worker->EV_A = NULL;
+      continue;
+    }
+    worker->threaded = true;
+  }
+
+  if ( (true == server->settings->acceptor_thread) && (0 != start_acceptor(server)) )
+  {
+    // without an acceptor thread the first worker can still accept for itself
+    print_err("failed to start the acceptor thread, accepting on the first worker instead\n");
+    worker = server->workers;
+    worker->listen_fd = server->acceptor.listen_fd;
+    server->acceptor.listen_fd = -1;
+    ev_io_set(&(worker->accept_watcher), worker->listen_fd, EV_READ);
+    ev_io_start(worker->EV_A, &(worker->accept_watcher));
+  }
+
+  print_debug("listening on port %d with %d worker(s)\n", server->port, server->num_workers);
+  return 0;
 }
 
-void close_tcp_server() {
-  server->on_close = NULL;
-  evn_server_close(server->EV_A, server);
+void close_tcp_server(evweb_server* server) {
+  int i;
+  evweb_worker* worker;
+
+  // stop handing out connections before the workers go away
+  if (true == server->acceptor.threaded)
+  {
+    ev_async_send(server->acceptor.EV_A, &(server->acceptor.stop_watcher));
+    pthread_join(server->acceptor.thread, NULL);
+    ev_loop_destroy(server->acceptor.EV_A);
+    server->acceptor.EV_A = NULL;
+    server->acceptor.threaded = false;
+  }
+
+  for (i = 0; i < server->num_workers; i += 1)
+  {
+    worker = server->workers + i;
+    if (true == worker->threaded)
+    {
+      // the loop belongs to another thread, so it has to stop its own watchers
+      ev_async_send(worker->EV_A, &(worker->stop_watcher));
+    }
+    else if (NULL != worker->EV_A)
+    {
+      on_worker_stop(worker->EV_A, &(worker->stop_watcher), EV_ASYNC);
+    }
+  }
+
+  // the threaded loops exit once their last connection has closed
+  for (i = 0; i < server->num_workers; i += 1)
+  {
+    worker = server->workers + i;
+    if (true == worker->threaded)
+    {
+      pthread_join(worker->thread, NULL);
+      ev_loop_destroy(worker->EV_A);
+      worker->EV_A = NULL;
+      worker->threaded = false;
+    }
+  }
+
+  server->closed = true;
+  release_tcp_server(server);
 }
 
-static void on_server_error(EV_P, struct evn_server* server, struct evn_exception* error) {
-  print_err("%s\n", error->message);
+void release_tcp_server(evweb_server* server) {
+  int i;
+
+  if (false == server->closed)
+  {
+    return;
+  }
+  for (i = 0; i < server->num_workers; i += 1)
+  {
+    if (server->workers[i].num_connections > 0)
+    {
+      print_debug("worker %d still has %d connections open, waiting to free the server\n", i, server->workers[i].num_connections);
+      return;
+    }
+  }
+
+  for (i = 0; i < server->num_workers; i += 1)
+  {
+    destroy_processer_pool(server->workers + i);
+    destroy_segment_pool(server->workers + i);
+    destroy_compress_filter(server->workers + i);
+    destroy_read_buffer_pool(server->workers + i);
+    if (NULL != server->workers[i].uring)
+    {
+      uring_destroy(server->workers[i].uring);
+    }
+  }
+  free(server->workers);
+  free(server);
+}
+
+static int listen_reuseport(int port) {
+  int fd;
+  int on = 1;
+  struct sockaddr_in address;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (-1 == fd)
+  {
+    print_err("failed to create listening socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // SO_REUSEPORT lets every worker bind its own socket to the same port, and the kernel
+  // spreads incoming connections across them
+  if ( (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on)) ||
+       (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on)) )
+  {
+    print_err("failed to set listening socket options: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  memset(&address, 0, sizeof address);
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (-1 == bind(fd, (struct sockaddr*)&address, sizeof address))
+  {
+    print_err("failed to bind to port %d: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (-1 == listen(fd, SOMAXCONN))
+  {
+    print_err("failed to listen on port %d: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void start_worker(evweb_worker* worker) {
+  if (true == worker->server->settings->io_uring)
+  {
+    worker->uring = uring_create(worker);
+  }
+
+  ev_io_init(&(worker->accept_watcher), on_accept, worker->listen_fd, EV_READ);
+  worker->accept_watcher.data = worker;
+  if (-1 != worker->listen_fd)
+  {
+    // one multishot accept keeps the connections coming without a syscall each
+    if ( (NULL == worker->uring) || (0 != uring_accept(worker->uring, worker->listen_fd)) )
+    {
+      ev_io_start(worker->EV_A, &(worker->accept_watcher));
+    }
+  }
+
+  ev_async_init(&(worker->handoff_watcher), on_handoff);
+  worker->handoff_watcher.data = worker;
+  if (true == worker->server->settings->acceptor_thread)
+  {
+    ev_async_start(worker->EV_A, &(worker->handoff_watcher));
+  }
+
+  ev_async_init(&(worker->stop_watcher), on_worker_stop);
+  worker->stop_watcher.data = worker;
+  if (worker != worker->server->workers)
+  {
+    ev_async_start(worker->EV_A, &(worker->stop_watcher));
+  }
+
+  start_compress_filter(worker);
+}
+
+static void stop_worker_watchers(evweb_worker* worker) {
+  ev_io_stop(worker->EV_A, &(worker->accept_watcher));
+  if (NULL != worker->uring)
+  {
+    uring_stop_accept(worker->uring);
+  }
+  ev_async_stop(worker->EV_A, &(worker->handoff_watcher));
+  ev_async_stop(worker->EV_A, &(worker->stop_watcher));
+  stop_compress_filter(worker);
+  if (-1 != worker->listen_fd)
+  {
+    close(worker->listen_fd);
+    worker->listen_fd = -1;
+  }
+}
+
+static void* run_worker(void* arg) {
+  evweb_worker* worker = (evweb_worker*)arg;
+
+  print_debug("worker %d running loop %p\n", worker->index, worker->EV_A);
+  ev_run(worker->EV_A, 0);
+  print_debug("worker %d loop finished\n", worker->index);
+
+  return NULL;
+}
+
+static void on_worker_stop(EV_P_ ev_async* watcher, int revents) {
+  evweb_worker* worker = (evweb_worker*)watcher->data;
+
+  print_debug("stopping worker %d\n", worker->index);
+  // pick up anything the acceptor queued before it stopped
+  on_handoff(EV_A_ &(worker->handoff_watcher), EV_ASYNC);
+  stop_worker_watchers(worker);
+}
+
+static void on_accept(EV_P_ ev_io* watcher, int revents) {
+  int fd;
+  evweb_worker* worker = (evweb_worker*)watcher->data;
+
+  // drain the backlog, another worker may have beaten us to some of it
+  while (true)
+  {
+    fd = accept4(worker->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (-1 == fd)
+    {
+      if (EINTR == errno)
+      {
+        continue;
+      }
+      if ( (EAGAIN != errno) && (EWOULDBLOCK != errno) )
+      {
+        print_err("failed to accept connection: %s\n", strerror(errno));
+      }
+      return;
+    }
+
+    accept_stream(EV_A, worker, fd);
+  }
+}
+
+static void on_handoff(EV_P_ ev_async* watcher, int revents) {
+  unsigned int head;
+  unsigned int tail;
+  evweb_worker* worker = (evweb_worker*)watcher->data;
+
+  // single producer (the acceptor) single consumer (us) ring, so the indexes are all the locking needed
+  head = __atomic_load_n(&(worker->handoff_head), __ATOMIC_RELAXED);
+  tail = __atomic_load_n(&(worker->handoff_tail), __ATOMIC_ACQUIRE);
+  while (head != tail)
+  {
+    accept_stream(EV_A, worker, worker->handoff_fds[head % EVWEB_HANDOFF_QUEUE_SIZE]);
+    head += 1;
+    __atomic_store_n(&(worker->handoff_head), head, __ATOMIC_RELEASE);
+  }
+}
+
+void accept_stream(EV_P, evweb_worker* worker, int fd) {
+  struct evn_stream* stream;
+  evweb_http_processer* processer;
+
+  stream = evn_stream_create(fd);
+  if (NULL == stream)
+  {
+    print_err("failed to create stream for new connection\n");
+    close(fd);
+    return;
+  }
+  stream->EV_A = EV_A;
+
+  if (false == on_connection(EV_A, worker, stream))
+  {
+    evn_stream_destroy(EV_A, stream);
+    return;
+  }
+  processer = (evweb_http_processer*)stream->send_data;
+
+  // libevn's read watcher stays idle. Either the kernel reads for us with io_uring, or we read
+  // into the worker's pooled buffers rather than have libevn malloc one for every read
+  if ( (NULL != worker->uring) && (0 == uring_receive(worker->uring, processer)) )
+  {
+    return;
+  }
+  ev_io_init(&(processer->read_watcher), on_readable, fd, EV_READ);
+  processer->read_watcher.data = stream;
+  ev_io_start(EV_A_ &(processer->read_watcher));
 }
 
-static void on_server_close(EV_P, struct evn_server* server) {
-  print_err("server closed\n");
-  exit(EXIT_FAILURE);
+static int start_acceptor(evweb_server* server) {
+  evweb_acceptor* acceptor = &(server->acceptor);
+
+  acceptor->EV_A = ev_loop_new(EVFLAG_AUTO);
+  if (NULL == acceptor->EV_A)
+  {
+    return -1;
+  }
+
+  ev_io_init(&(acceptor->accept_watcher), on_acceptor_accept, acceptor->listen_fd, EV_READ);
+  acceptor->accept_watcher.data = server;
+  ev_io_start(acceptor->EV_A, &(acceptor->accept_watcher));
+
+  ev_async_init(&(acceptor->stop_watcher), on_acceptor_stop);
+  acceptor->stop_watcher.data = server;
+  ev_async_start(acceptor->EV_A, &(acceptor->stop_watcher));
+
+  if (0 != pthread_create(&(acceptor->thread), NULL, run_acceptor, server))
+  {
+    ev_loop_destroy(acceptor->EV_A);
+    acceptor->EV_A = NULL;
+    return -1;
+  }
+  acceptor->threaded = true;
+
+  return 0;
 }
 
-static void on_connection(EV_P, struct evn_server* server, struct evn_stream* stream) {
+static void* run_acceptor(void* arg) {
+  evweb_server* server = (evweb_server*)arg;
+
+  print_debug("acceptor running loop %p\n", server->acceptor.EV_A);
+  ev_run(server->acceptor.EV_A, 0);
+  print_debug("acceptor loop finished\n");
+
+  return NULL;
+}
+
+static void on_acceptor_stop(EV_P_ ev_async* watcher, int revents) {
+  evweb_acceptor* acceptor = &(((evweb_server*)watcher->data)->acceptor);
+
+  print_debug("stopping acceptor\n");
+  ev_io_stop(EV_A_ &(acceptor->accept_watcher));
+  ev_async_stop(EV_A_ &(acceptor->stop_watcher));
+  close(acceptor->listen_fd);
+  acceptor->listen_fd = -1;
+}
+
+static void on_acceptor_accept(EV_P_ ev_io* watcher, int revents) {
+  int fd;
+  evweb_server* server = (evweb_server*)watcher->data;
+
+  while (true)
+  {
+    fd = accept4(server->acceptor.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (-1 == fd)
+    {
+      if (EINTR == errno)
+      {
+        continue;
+      }
+      if ( (EAGAIN != errno) && (EWOULDBLOCK != errno) )
+      {
+        print_err("failed to accept connection: %s\n", strerror(errno));
+      }
+      return;
+    }
+
+    if (false == handoff_fd(server, fd))
+    {
+      print_err("every worker's handoff queue is full, dropping connection\n");
+      close(fd);
+    }
+  }
+}
+
+static bool handoff_fd(evweb_server* server, int fd) {
+  int i;
+  int index;
+  int best = -1;
+  int best_count = 0;
+  int count;
+  unsigned int head;
+  unsigned int tail;
+  evweb_worker* worker;
+
+  // start from a rotating position so ties don't all land on the first worker, then
+  // prefer whichever worker currently holds the fewest connections
+  for (i = 0; i < server->num_workers; i += 1)
+  {
+    index = (server->acceptor.next_worker + i) % server->num_workers;
+    worker = server->workers + index;
+    if (NULL == worker->EV_A)
+    {
+      continue;
+    }
+
+    head = __atomic_load_n(&(worker->handoff_head), __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&(worker->handoff_tail), __ATOMIC_RELAXED);
+    if (tail - head >= EVWEB_HANDOFF_QUEUE_SIZE)
+    {
+      continue;
+    }
+
+    count = __atomic_load_n(&(worker->num_connections), __ATOMIC_RELAXED) + (int)(tail - head);
+    if ( (-1 == best) || (count < best_count) )
+    {
+      best = index;
+      best_count = count;
+    }
+  }
+  if (-1 == best)
+  {
+    return false;
+  }
+  server->acceptor.next_worker = (best + 1) % server->num_workers;
+
+  worker = server->workers + best;
+  tail = __atomic_load_n(&(worker->handoff_tail), __ATOMIC_RELAXED);
+  worker->handoff_fds[tail % EVWEB_HANDOFF_QUEUE_SIZE] = fd;
+  __atomic_store_n(&(worker->handoff_tail), tail + 1, __ATOMIC_RELEASE);
+  ev_async_send(worker->EV_A, &(worker->handoff_watcher));
+
+  return true;
+}
+
+static bool on_connection(EV_P, evweb_worker* worker, struct evn_stream* stream) {
   evweb_http_processer* http_processer;
 
-  print_debug("connection established\n");
+  print_debug("connection established on worker %d\n", worker->index);
 
-  // initialize the http_processer object for this connection
-  // we want to use calloc so all of the pointer start as NULL, and all the counters start at 0
-  http_processer = calloc(1, sizeof (evweb_http_processer));
+  // initialize the http_processer object for this connection, reusing one from the pool if we can
+  http_processer = acquire_processer(worker);
+  if (NULL == http_processer)
+  {
+    return false;
+  }
   stream->send_data = http_processer;
   http_processer->parser.data = stream;
   http_parser_init(&(http_processer->parser), HTTP_REQUEST);
+  __atomic_add_fetch(&(worker->num_connections), 1, __ATOMIC_RELAXED);
 
   stream->on_data = on_stream_data;
   stream->on_end = on_stream_end;
@@ -82,10 +569,56 @@ static void on_connection(EV_P, struct evn_server* server, struct evn_stream* st
   stream->on_close = on_stream_close;
   stream->oneshot = false;
 
-  evn_stream_set_timeout(EV_A, stream, server_settings->max_keep_alive * 1000);
+  evn_stream_set_timeout(EV_A, stream, worker->server->settings->max_keep_alive * 1000);
+  return true;
+}
+
+static void on_readable(EV_P_ ev_io* watcher, int revents) {
+  struct evn_stream* stream = (struct evn_stream*)watcher->data;
+  evweb_http_processer* processer = (evweb_http_processer*)stream->send_data;
+  evweb_worker* worker = processer->worker;
+  char* buffer;
+  size_t capacity;
+  ssize_t size;
+
+  buffer = acquire_read_buffer(worker, processer->read_size, &capacity);
+  if (NULL == buffer)
+  {
+    evn_stream_destroy(EV_A, stream);
+    return;
+  }
+
+  size = read(stream->fd, buffer, capacity);
+  if (size > 0)
+  {
+    update_read_size(processer, size, capacity);
+    evn_stream_set_timeout(EV_A, stream, worker->server->settings->max_keep_alive * 1000);
+    receive_input(EV_A, stream, buffer, size, release_read_buffer, worker);
+    return;
+  }
+
+  release_read_buffer(worker, buffer);
+  if (0 == size)
+  {
+    // the socket stays readable from here on, so stop listening before finishing up
+    ev_io_stop(EV_A, watcher);
+    end_input(EV_A, stream);
+  }
+  else if ( (EAGAIN != errno) && (EWOULDBLOCK != errno) && (EINTR != errno) )
+  {
+    print_debug("read on connection (%p) failed: %s\n", stream, strerror(errno));
+    evn_stream_destroy(EV_A, stream);
+  }
 }
 
 static void on_stream_data(EV_P, struct evn_stream* stream, void* data, int size) {
+  // libevn read into a buffer of its own, which is ours to free
+  receive_input(EV_A, stream, data, size, NULL, NULL);
+}
+
+// Parse what was read from the connection and send whatever responses that finished. data is
+// given back with release (or freed if that's NULL) once nothing points into it anymore.
+void receive_input(EV_P, struct evn_stream* stream, void* data, int size, evweb_release_cb* release, void* release_ctx) {
   int nparsed;
   http_parser_settings* parser_cbs;
   evweb_http_processer* parser = (evweb_http_processer*)stream->send_data;
@@ -101,7 +634,35 @@ static void on_stream_data(EV_P, struct evn_stream* stream, void* data, int size
   }
 
   parser_cbs = get_http_parser_settings();
+  parser->input_start = data;
+  parser->input_end = (char*)data + size;
+  parser->input_held = false;
+  parser->defer_flush = true;
   nparsed = http_parser_execute(&(parser->parser), parser_cbs, data, size);
+  parser->defer_flush = false;
+
+  // the request's url and headers may point straight into this buffer, in which case it has
+  // to live until the next message begins (or the connection closes)
+  parser->input_start = NULL;
+  parser->input_end = NULL;
+  if (false == parser->input_held)
+  {
+    give_back_input(data, release, release_ctx);
+  }
+  else if (0 != hold_input_buffer(parser, data, release, release_ctx))
+  {
+    print_err("could not hold on to the read buffer, closing the connection\n");
+    give_back_input(data, release, release_ctx);
+    evn_stream_destroy(EV_A, stream);
+    return;
+  }
+
+  // every pipelined response the handlers finished during this read goes out in one write
+  flush_exchanges(parser);
+  if (evn_CLOSED == stream->ready_state)
+  {
+    return;
+  }
 
   if (0 != parser->parser.upgrade)
   {
@@ -109,19 +670,62 @@ static void on_stream_data(EV_P, struct evn_stream* stream, void* data, int size
     evn_stream_write(EV_A, stream, "we don't support upgrades", strlen("we don't support upgrades"));
     evn_stream_destroy(EV_A, stream);
   }
+  else if ( (nparsed != size) && (HPE_CLOSED_CONNECTION == HTTP_PARSER_ERRNO(&(parser->parser))) )
+  {
+    print_debug("ignoring data received after the connection's last request\n");
+  }
   else if (nparsed != size)
   {
     print_err("parser did not read all of the data we feed it\n");
     evn_stream_destroy(EV_A, stream);
   }
-
-  free(data);
 }
 
 static void on_stream_end(EV_P, struct evn_stream* stream) {
   print_debug("client (%p) sent FIN\n", stream);
 }
 
+// The client closed its side, which we only hear about ourselves when we do the reading. Let
+// the responses already in flight finish and hang up after them.
+void end_input(EV_P, struct evn_stream* stream) {
+  evweb_http_processer* processer = (evweb_http_processer*)stream->send_data;
+
+  on_stream_end(EV_A, stream);
+  processer->closing = true;
+
+  // a request cut off halfway will never be answered, so it mustn't hold up the close
+  if ( (NULL != processer->last_exchange) && (false == processer->last_exchange->complete) )
+  {
+    print_debug("client (%p) sent FIN in the middle of a request\n", stream);
+    drop_last_exchange(processer);
+  }
+
+  if (NULL != processer->exchanges)
+  {
+    processer->last_exchange->keep_alive = false;
+    flush_exchanges(processer);
+  }
+  else if (true == processer->write_pending)
+  {
+    processer->close_on_drain = true;
+  }
+  else
+  {
+    evn_stream_destroy(EV_A, stream);
+  }
+}
+
+static void give_back_input(void* data, evweb_release_cb* release, void* release_ctx) {
+  if (NULL != release)
+  {
+    release(release_ctx, data);
+  }
+  else
+  {
+    free(data);
+  }
+}
+
 static void on_stream_timeout(EV_P, struct evn_stream* stream) {
   if ( (stream->ready_state != evn_READ_ONLY) && (stream->ready_state != evn_CLOSED) )
   {
@@ -140,67 +744,41 @@ static void on_stream_error(EV_P, struct evn_stream* stream, struct evn_exceptio
 }
 
 static void on_stream_close(EV_P, struct evn_stream* stream, bool had_error) {
-  int i;
-  evweb_header_line* current_line;
   evweb_http_processer* parser = (evweb_http_processer*)stream->send_data;
 
-  // free everything in the http parser associated with this connection
+  // a file might have been waiting on the socket, and the watchers live in the processer
+  ev_io_stop(EV_A, &(parser->write_watcher));
+  ev_io_stop(EV_A, &(parser->read_watcher));
 
-  // first all of the request information
-  current_line = parser->request.header_lines;
-  for (i = 0; i < parser->request.num_header_lines; i += 1)
+  print_debug("connection (%p) closed at %f\n", stream, ev_now(EV_A));
+  if (true == had_error)
   {
-    free(current_line->field);
-    current_line->field = NULL;
-    free(current_line->value);
-    current_line->value = NULL;
-    current_line += 1;
+    print_err("error occured while closing connection (%p) (could have been from timeout)\n", stream);
   }
-  free(parser->request.header_lines);
-  parser->request.header_lines = NULL;
-  parser->request.num_header_lines = 0;
-  parser->request.max_num_header_lines = 0;
 
-  free(parser->request.url);
-  parser->request.url = NULL;
-  parser->request.url_length = 0;
-
-  free(parser->request.body);
-  parser->request.body = NULL;
-  parser->request.body_length = 0;
-
-  // then all the response information
-  current_line = parser->response.header_lines;
-  for (i = 0; i < parser->response.num_header_lines; i += 1)
+  // the stream is gone either way, but a receive the kernel still has for it will complete
+  // into the processer, so that has to wait
+  if (NULL != parser->worker->uring)
   {
-    free(current_line->field);
-    current_line->field = NULL;
-    free(current_line->value);
-    current_line->value = NULL;
-    current_line += 1;
+    if (true == uring_forget(parser->worker->uring, parser))
+    {
+      return;
+    }
   }
-  free(parser->response.header_lines);
-  parser->response.header_lines = NULL;
-  parser->response.num_header_lines = 0;
-  parser->response.max_num_header_lines = 0;
-
-  free(parser->response.status_message);
-  parser->response.status_message = NULL;
-
-  free(parser->response.content);
-  parser->response.content = NULL;
-  parser->response.content_length = 0;
-
-  free(parser->response.content_type);
-  parser->response.content_type = NULL;
+  finish_connection(parser);
+}
 
-  free(parser);
+// hand the processer back to this worker's pool for the next connection
+void finish_connection(evweb_http_processer* processer) {
+  evweb_worker* worker = processer->worker;
 
+  release_processer(worker, processer);
+  __atomic_sub_fetch(&(worker->num_connections), 1, __ATOMIC_RELAXED);
 
-  print_debug("connection (%p) closed at %f\n", stream, ev_now(EV_A));
-  if (true == had_error)
+  // threaded workers are already joined by the time the server is marked closed
+  if (false == worker->threaded)
   {
-    print_err("error occured while closing connection (%p) (could have been from timeout)\n", stream);
+    release_tcp_server(worker->server);
   }
 }
 
@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "evweb.h"
+#include "tcp-server.h"
+#include "uring.h"
+
+#ifndef DEBUG_URING
+  #ifdef DEBUG
+    #define DEBUG_URING 1
+  #else
+    #define DEBUG_URING 0
+  #endif
+#endif
+
+#if DEBUG_URING
+  #define print_debug(...) printf("[uring] " __VA_ARGS__)
+#else
+  #define print_debug(...)
+#endif
+#define print_status(...) printf("[uring] " __VA_ARGS__)
+#define print_err(...) fprintf(stderr, "[uring] " __VA_ARGS__)
+
+// what a completion is for. Receives carry their processer, which is always aligned enough
+// that these can't be mistaken for one
+#define URING_ACCEPT  ((uint64_t)1)
+#define URING_IGNORE  ((uint64_t)2)
+
+static int map_rings(evweb_uring* uring, struct io_uring_params* params);
+static int setup_buffers(evweb_uring* uring);
+static struct io_uring_sqe* get_sqe(evweb_uring* uring);
+static void submit(evweb_uring* uring);
+static void cancel(evweb_uring* uring, uint64_t user_data);
+static void add_buffer(evweb_uring* uring, unsigned short id);
+static void release_buffer(void* ctx, void* data);
+static void on_completions(EV_P, ev_io* watcher, int revents);
+static void complete_accept(evweb_uring* uring, int res, unsigned flags);
+static void complete_receive(evweb_uring* uring, evweb_http_processer* processer, int res, unsigned flags);
+
+// Set up a ring for the worker, or return NULL if the kernel can't do everything we need
+// (multishot accept and receive, provided buffer rings), in which case libev does the work.
+evweb_uring* uring_create(evweb_worker* worker) {
+  struct io_uring_params params;
+  evweb_uring* uring;
+  int event_fd;
+
+  uring = calloc(1, sizeof (evweb_uring));
+  if (NULL == uring)
+  {
+    print_err("failed to allocate memory for io_uring: %s\n", strerror(errno));
+    return NULL;
+  }
+  uring->worker = worker;
+  uring->event_fd = -1;
+  uring->listen_fd = -1;
+
+  memset(&params, 0, sizeof params);
+  params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+  uring->ring_fd = syscall(__NR_io_uring_setup, EVWEB_URING_ENTRIES, &params);
+  if (-1 == uring->ring_fd)
+  {
+    print_err("io_uring isn't available, using libev instead: %s\n", strerror(errno));
+    free(uring);
+    return NULL;
+  }
+
+  if ( (0 != map_rings(uring, &params)) || (0 != setup_buffers(uring)) )
+  {
+    uring_destroy(uring);
+    return NULL;
+  }
+
+  // completions wake the worker's loop like any other event
+  uring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  event_fd = uring->event_fd;
+  if ( (-1 == event_fd) || (0 != syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1)) )
+  {
+    print_err("failed to register an eventfd with io_uring, using libev instead: %s\n", strerror(errno));
+    uring_destroy(uring);
+    return NULL;
+  }
+  ev_io_init(&(uring->event_watcher), on_completions, uring->event_fd, EV_READ);
+  uring->event_watcher.data = uring;
+  ev_io_start(worker->EV_A, &(uring->event_watcher));
+  // the ring only keeps the loop alive while it's accepting or finishing a receive
+  ev_unref(worker->EV_A);
+
+  print_debug("worker %d is using io_uring\n", worker->index);
+  return uring;
+}
+
+void uring_destroy(evweb_uring* uring) {
+  if (ev_is_active(&(uring->event_watcher)) && (NULL != uring->worker->EV_A))
+  {
+    ev_ref(uring->worker->EV_A);
+    ev_io_stop(uring->worker->EV_A, &(uring->event_watcher));
+  }
+
+  // closing the ring cancels anything the kernel still has
+  if (-1 != uring->ring_fd)
+  {
+    close(uring->ring_fd);
+  }
+  if (-1 != uring->event_fd)
+  {
+    close(uring->event_fd);
+  }
+  if (NULL != uring->buffers)
+  {
+    munmap(uring->buffers, EVWEB_URING_BUFFERS * EVWEB_URING_BUFFER_SIZE);
+  }
+  if (NULL != uring->buf_ring)
+  {
+    munmap(uring->buf_ring, uring->buf_ring_size);
+  }
+  if (NULL != uring->sqes)
+  {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if ( (NULL != uring->cq_ring) && (uring->cq_ring != uring->sq_ring) )
+  {
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  }
+  if (NULL != uring->sq_ring)
+  {
+    munmap(uring->sq_ring, uring->sq_ring_size);
+  }
+  free(uring);
+}
+
+// One accept that keeps producing connections until it's cancelled
+int uring_accept(evweb_uring* uring, int listen_fd) {
+  struct io_uring_sqe* sqe;
+
+  sqe = get_sqe(uring);
+  if (NULL == sqe)
+  {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = URING_ACCEPT;
+  submit(uring);
+
+  if (false == uring->accepting)
+  {
+    ev_ref(uring->worker->EV_A);
+  }
+  uring->listen_fd = listen_fd;
+  uring->accepting = true;
+  return 0;
+}
+
+void uring_stop_accept(evweb_uring* uring) {
+  if (false == uring->accepting)
+  {
+    return;
+  }
+  uring->accepting = false;
+  cancel(uring, URING_ACCEPT);
+  ev_unref(uring->worker->EV_A);
+}
+
+// One receive that keeps reading into whichever provided buffer is free, until the connection
+// ends or the buffers run out
+int uring_receive(evweb_uring* uring, evweb_http_processer* processer) {
+  struct evn_stream* stream = (struct evn_stream*)processer->parser.data;
+  struct io_uring_sqe* sqe;
+
+  sqe = get_sqe(uring);
+  if (NULL == sqe)
+  {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = stream->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = EVWEB_URING_BUFFER_GROUP;
+  sqe->user_data = (uint64_t)(uintptr_t)processer;
+  submit(uring);
+
+  processer->recv_armed = true;
+  processer->recv_starved = false;
+  processer->copy_tokens = true;
+  return 0;
+}
+
+// The processer's stream has closed. Returns true if a receive is still in the kernel's hands,
+// in which case the processer is finished once that completes.
+bool uring_forget(evweb_uring* uring, evweb_http_processer* processer) {
+  evweb_http_processer** link;
+
+  if (true == processer->recv_starved)
+  {
+    for (link = &(uring->starved); NULL != *link; link = &((*link)->next_starved))
+    {
+      if (processer == *link)
+      {
+        *link = processer->next_starved;
+        break;
+      }
+    }
+    processer->recv_starved = false;
+    return false;
+  }
+  if (false == processer->recv_armed)
+  {
+    return false;
+  }
+
+  processer->stream_closed = true;
+  cancel(uring, (uint64_t)(uintptr_t)processer);
+  // the loop has to stay up to hear the receive finish
+  ev_ref(uring->worker->EV_A);
+  return true;
+}
+
+static int map_rings(evweb_uring* uring, struct io_uring_params* params) {
+  uring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof (unsigned);
+  uring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof (struct io_uring_cqe);
+  if (IORING_FEAT_SINGLE_MMAP & params->features)
+  {
+    if (uring->cq_ring_size > uring->sq_ring_size)
+    {
+      uring->sq_ring_size = uring->cq_ring_size;
+    }
+    uring->cq_ring_size = uring->sq_ring_size;
+  }
+
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == uring->sq_ring)
+  {
+    uring->sq_ring = NULL;
+    print_err("failed to map the io_uring submission queue: %s\n", strerror(errno));
+    return -1;
+  }
+  if (IORING_FEAT_SINGLE_MMAP & params->features)
+  {
+    uring->cq_ring = uring->sq_ring;
+  }
+  else
+  {
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == uring->cq_ring)
+    {
+      uring->cq_ring = NULL;
+      print_err("failed to map the io_uring completion queue: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  uring->sqes_size = params->sq_entries * sizeof (struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+  if (MAP_FAILED == uring->sqes)
+  {
+    uring->sqes = NULL;
+    print_err("failed to map the io_uring submission entries: %s\n", strerror(errno));
+    return -1;
+  }
+
+  uring->sq_head = (unsigned*)((char*)uring->sq_ring + params->sq_off.head);
+  uring->sq_tail = (unsigned*)((char*)uring->sq_ring + params->sq_off.tail);
+  uring->sq_array = (unsigned*)((char*)uring->sq_ring + params->sq_off.array);
+  uring->sq_mask = *(unsigned*)((char*)uring->sq_ring + params->sq_off.ring_mask);
+  uring->sq_entries = params->sq_entries;
+  uring->sq_local_tail = *(uring->sq_tail);
+
+  uring->cq_head = (unsigned*)((char*)uring->cq_ring + params->cq_off.head);
+  uring->cq_tail = (unsigned*)((char*)uring->cq_ring + params->cq_off.tail);
+  uring->cq_mask = *(unsigned*)((char*)uring->cq_ring + params->cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe*)((char*)uring->cq_ring + params->cq_off.cqes);
+  return 0;
+}
+
+// Hand the kernel a ring of receive buffers to pick from, so a connection only takes one up
+// while there's actually data for it rather than each having a buffer of its own.
+static int setup_buffers(evweb_uring* uring) {
+  struct io_uring_buf_reg reg;
+  int i;
+
+  uring->buf_ring_size = EVWEB_URING_BUFFERS * sizeof (struct io_uring_buf);
+  uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  uring->buffers = mmap(NULL, EVWEB_URING_BUFFERS * EVWEB_URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ( (MAP_FAILED == uring->buf_ring) || (MAP_FAILED == uring->buffers) )
+  {
+    print_err("failed to allocate io_uring receive buffers: %s\n", strerror(errno));
+    uring->buf_ring = (MAP_FAILED == uring->buf_ring) ? NULL : uring->buf_ring;
+    uring->buffers = (MAP_FAILED == uring->buffers) ? NULL : uring->buffers;
+    return -1;
+  }
+
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+  reg.ring_entries = EVWEB_URING_BUFFERS;
+  reg.bgid = EVWEB_URING_BUFFER_GROUP;
+  if (0 != syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+  {
+    print_err("io_uring can't take provided buffer rings, using libev instead: %s\n", strerror(errno));
+    return -1;
+  }
+
+  for (i = 0; i < EVWEB_URING_BUFFERS; i += 1)
+  {
+    add_buffer(uring, i);
+  }
+  __atomic_store_n(&(uring->buf_ring->tail), uring->buf_tail, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static struct io_uring_sqe* get_sqe(evweb_uring* uring) {
+  struct io_uring_sqe* sqe;
+  unsigned index;
+
+  if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries)
+  {
+    submit(uring);
+    if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries)
+    {
+      print_err("io_uring submission queue is full\n");
+      return NULL;
+    }
+  }
+
+  index = uring->sq_local_tail & uring->sq_mask;
+  sqe = uring->sqes + index;
+  memset(sqe, 0, sizeof (struct io_uring_sqe));
+  uring->sq_array[index] = index;
+  uring->sq_local_tail += 1;
+  return sqe;
+}
+
+static void submit(evweb_uring* uring) {
+  unsigned to_submit;
+  int ret;
+
+  __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+  to_submit = uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+  while (to_submit > 0)
+  {
+    ret = syscall(__NR_io_uring_enter, uring->ring_fd, to_submit, 0, 0, NULL, 0);
+    if ( (-1 == ret) && (EINTR == errno) )
+    {
+      continue;
+    }
+    if (-1 == ret)
+    {
+      print_err("failed to submit to io_uring: %s\n", strerror(errno));
+    }
+    break;
+  }
+}
+
+static void cancel(evweb_uring* uring, uint64_t user_data) {
+  struct io_uring_sqe* sqe;
+
+  sqe = get_sqe(uring);
+  if (NULL == sqe)
+  {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data;
+  sqe->user_data = URING_IGNORE;
+  submit(uring);
+}
+
+static void add_buffer(evweb_uring* uring, unsigned short id) {
+  struct io_uring_buf* buf;
+
+  buf = uring->buf_ring->bufs + (uring->buf_tail & (EVWEB_URING_BUFFERS - 1));
+  buf->addr = (uint64_t)(uintptr_t)(uring->buffers + (size_t)id * EVWEB_URING_BUFFER_SIZE);
+  buf->len = EVWEB_URING_BUFFER_SIZE;
+  buf->bid = id;
+  uring->buf_tail += 1;
+}
+
+// evweb_release_cb for receive buffers, once parsing is done with them they go back in the ring
+static void release_buffer(void* ctx, void* data) {
+  evweb_uring* uring = (evweb_uring*)ctx;
+  evweb_http_processer* processer;
+
+  add_buffer(uring, ((char*)data - uring->buffers) / EVWEB_URING_BUFFER_SIZE);
+  __atomic_store_n(&(uring->buf_ring->tail), uring->buf_tail, __ATOMIC_RELEASE);
+
+  // anyone who ran dry can read again
+  while (NULL != uring->starved)
+  {
+    processer = uring->starved;
+    uring->starved = processer->next_starved;
+    processer->next_starved = NULL;
+    if (0 != uring_receive(uring, processer))
+    {
+      processer->next_starved = uring->starved;
+      uring->starved = processer;
+      break;
+    }
+  }
+}
+
+static void on_completions(EV_P, ev_io* watcher, int revents) {
+  evweb_uring* uring = (evweb_uring*)watcher->data;
+  struct io_uring_cqe* cqe;
+  uint64_t user_data;
+  uint64_t count;
+  unsigned head;
+  int res;
+  unsigned flags;
+
+  if (-1 == read(uring->event_fd, &count, sizeof count))
+  {
+    print_debug("eventfd read: %s\n", strerror(errno));
+  }
+
+  head = *(uring->cq_head);
+  while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+  {
+    // copy it out and hand the slot back before doing anything that might submit more
+    cqe = uring->cqes + (head & uring->cq_mask);
+    user_data = cqe->user_data;
+    res = cqe->res;
+    flags = cqe->flags;
+    head += 1;
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (URING_ACCEPT == user_data)
+    {
+      complete_accept(uring, res, flags);
+    }
+    else if (URING_IGNORE != user_data)
+    {
+      complete_receive(uring, (evweb_http_processer*)(uintptr_t)user_data, res, flags);
+    }
+  }
+}
+
+static void complete_accept(evweb_uring* uring, int res, unsigned flags) {
+  if (res >= 0)
+  {
+    accept_stream(uring->worker->EV_A, uring->worker, res);
+  }
+  else if (-ECANCELED != res)
+  {
+    print_err("failed to accept connection: %s\n", strerror(-res));
+  }
+
+  // the kernel gives up on a multishot accept after some errors, so start another
+  if ( (0 == (IORING_CQE_F_MORE & flags)) && (true == uring->accepting) && (-ECANCELED != res) )
+  {
+    uring->accepting = false;
+    ev_unref(uring->worker->EV_A);
+    uring_accept(uring, uring->listen_fd);
+  }
+}
+
+static void complete_receive(evweb_uring* uring, evweb_http_processer* processer, int res, unsigned flags) {
+  evweb_worker* worker = uring->worker;
+  struct evn_stream* stream = (struct evn_stream*)processer->parser.data;
+  char* data = NULL;
+
+  if (IORING_CQE_F_BUFFER & flags)
+  {
+    data = uring->buffers + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * EVWEB_URING_BUFFER_SIZE;
+  }
+
+  // recv_armed stays set until we're done here, so a stream closing under us leaves the
+  // processer for us to finish
+  if (true == processer->stream_closed)
+  {
+    if (NULL != data)
+    {
+      release_buffer(uring, data);
+    }
+  }
+  else if (res > 0)
+  {
+    print_debug("received %d bytes over connection (%p)\n", res, stream);
+    evn_stream_set_timeout(worker->EV_A, stream, worker->server->settings->max_keep_alive * 1000);
+    // with copy_tokens set nothing points into the slot once it's parsed, so it's back in the
+    // ring before receive_input returns
+    receive_input(worker->EV_A, stream, data, res, release_buffer, uring);
+  }
+  else
+  {
+    if (NULL != data)
+    {
+      release_buffer(uring, data);
+    }
+    if (0 == res)
+    {
+      end_input(worker->EV_A, stream);
+    }
+    else if (-ENOBUFS == res)
+    {
+      print_debug("out of receive buffers, connection (%p) waits for one\n", stream);
+    }
+    else if (-ECANCELED != res)
+    {
+      print_debug("receive on connection (%p) failed: %s\n", stream, strerror(-res));
+      evn_stream_destroy(worker->EV_A, stream);
+    }
+  }
+
+  if (IORING_CQE_F_MORE & flags)
+  {
+    return;
+  }
+  processer->recv_armed = false;
+  if (true == processer->stream_closed)
+  {
+    ev_unref(worker->EV_A);
+    finish_connection(processer);
+  }
+  else if (-ENOBUFS == res)
+  {
+    processer->recv_starved = true;
+    processer->next_starved = uring->starved;
+    uring->starved = processer;
+  }
+  else if (res > 0)
+  {
+    uring_receive(uring, processer);
+  }
+}